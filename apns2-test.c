@@ -21,53 +21,404 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <assert.h>
 
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <time.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ecdsa.h>
 
 #include <nghttp2/nghttp2.h>
 
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define TOKEN_SIMD
+#endif
+
 #define APNS2_TEST_VERSION "0.1.1"
 
+/* upper bound on streams kept in flight on one session, whatever the
+   server advertises in SETTINGS_MAX_CONCURRENT_STREAMS */
+#define MAX_INFLIGHT_STREAMS 1000
+#define MAX_TOKEN_LEN        256
+/* a device token: 32 bytes, sent as 64 hex digits */
+#define TOKEN_BIN_LEN        32
+#define TOKEN_HEX_LEN        (2 * TOKEN_BIN_LEN)
+/* one -tokens line: the token and, with -template, its fields */
+#define MAX_RECIPIENT_LEN    512
+/* APNs rejects larger payloads */
+#define MAX_PAYLOAD_LEN      4096
+#define MAX_TEMPLATE_FIELDS  16
+#define MAX_TEMPLATE_SEGS    64
+#define MAX_CONNECTIONS      1024
+/* -cert given more than once: one tenant each */
+#define MAX_TENANTS          64
+#define CERT_EXPIRY_WARN_DAYS 30
+#define MAX_EPOLL_EVENTS     64
+/* seconds without any input before a busy connection is given up */
+#define DEFAULT_IO_TIMEOUT   30
+#define MAX_THREADS          256
+/* tokens queued per worker thread, must be a power of two */
+#define WORK_QUEUE_SIZE      4096
+#define CACHELINE_SIZE       64
+/* consecutive failed reconnects before a pool slot is given up */
+#define MAX_RECONNECT_TRIES  3
+/* output staged per connection, one full TLS record of plaintext */
+#define OUTBUF_SIZE          16384
+/* longest request line accepted on the -daemon socket */
+#define MAX_REQUEST_LEN      (64 * 1024)
+/* extra apns-* headers one -daemon request may carry */
+#define MAX_PUSH_HEADERS     8
+/* TLS sessions kept per host, port and client certificate */
+#define SESSION_CACHE_SLOTS  16
+#define SESSION_KEY_LEN      352
+/* APNs rejects provider tokens older than an hour and re-signing more
+   often than every 20 minutes */
+#define JWT_REFRESH_SECS     (50 * 60)
+#define JWT_CHECK_MS         (60 * 1000)
+#define MAX_RESOLVED_ADDRS   16
+/* seconds a lookup is reused; getaddrinfo() does not tell the DNS TTL */
+#define DEFAULT_DNS_TTL      60
+/* RFC 8305 connection attempt delay */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+/* limit for a connect and TLS handshake when -timeout 0 disables it */
+#define CONNECT_TIMEOUT_MS   (30 * 1000)
+/* an address that failed to connect is tried last for this long */
+#define ENDPOINT_PENALTY_MS  (30 * 1000)
+/* results go to the output thread in chunks of at most this size,
+   through a ring of SINK_RING_SIZE bytes per pool */
+#define WRITER_SIZE          (64 * 1024)
+#define SINK_RING_SIZE       (4 * 1024 * 1024)
+/* after a small write the output thread waits this long for more */
+#define SINK_LINGER_MS       5
+#define SINK_MAX_IOV         64
+/* -output-rotate keeps <file>.1 .. <file>.SINK_KEEP */
+#define SINK_KEEP            9
+/* response body kept per stream; APNs error bodies are a few dozen bytes */
+#define MAX_RESPONSE_BODY    4096
+/* latency histograms: 32 sub-buckets per power of two, about 3%
+   precision, microsecond values up to 2^40 */
+#define HIST_SUB_BITS        5
+#define HIST_MAX_BITS        40
+#define HIST_BUCKETS         ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+/* per pool allocator: power of two size classes from 32 bytes to 16 KB,
+   with at most this much kept for reuse per class */
+#define MEM_MIN_SHIFT        5
+#define MEM_CLASSES          10
+#define MEM_CACHE_BYTES      (1024 * 1024)
+/* loop timers: 4 levels of 64 slots of 1, 64, 4096 and 262144 ms,
+   about 4.6 hours; later timers wait in the last level */
+#define WHEEL_BITS           6
+#define WHEEL_SLOTS          (1 << WHEEL_BITS)
+#define WHEEL_MASK           (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS         4
+/* retries of a throttled or failed request: exponential backoff from
+   the base, capped, with half of each delay random */
+#define DEFAULT_RETRIES      3
+#define RETRY_BASE_MS        200
+#define RETRY_MAX_MS         (30 * 1000)
+/* -ping: seconds between PINGs on a connection, and how long an answer
+   may take before the connection is replaced */
+#define DEFAULT_PING_SECS    60
+#define PING_TIMEOUT_MS      (10 * 1000)
+/* a connection whose round trip is this many times the best one, and
+   at least RTT_DEGRADED_MIN_US longer, only gets streams others can't take */
+#define RTT_DEGRADED_FACTOR  4
+#define RTT_DEGRADED_MIN_US  5000
+/* -dead-tokens file format; a new store starts with DEAD_MIN_SLOTS */
+#define DEAD_MAGIC           "APNSDEAD"
+#define DEAD_VERSION         1
+#define DEAD_MIN_SLOTS       (1 << 16)
+/* a store this full that failed to grow takes no more tokens */
+#define DEAD_MAX_LOAD(slots) ((slots) / 4 * 3)
+/* times a request the server never saw may move to another connection */
+#define MAX_MIGRATIONS       8
+/* per topic send rate: a burst of this many seconds of the rate; after
+   a 429 the rate is halved at most once per THROTTLE_HOLD_MS and every
+   success adds back this many requests per second */
+#define BUCKET_BURST_SECS    0.1
+#define THROTTLE_HOLD_MS     1000
+#define BUCKET_RECOVERY      0.05
+
+/* what the latency histograms measure, see -stats */
+enum {
+    PHASE_DNS,
+    PHASE_CONNECT,
+    PHASE_TLS,
+    PHASE_SETTINGS,
+    PHASE_PING,
+    PHASE_HEADER,
+    PHASE_TOTAL,
+    PHASE_MAX
+};
+
 enum {
     IO_NONE,
     WANT_READ,
     WANT_WRITE
 };
 
-#define MAKE_NV(NAME, VALUE)                                                   \
+/* header with a name and value that live as long as the run */
+#define MAKE_NV(NAME, VALUE, VALUELEN)                                         \
   {                                                                            \
-    (uint8_t *) NAME, (uint8_t *)VALUE, sizeof(NAME) - 1, sizeof(VALUE) - 1,   \
-        NGHTTP2_NV_FLAG_NONE                                                   \
+    (uint8_t *) NAME, (uint8_t *)VALUE, sizeof(NAME) - 1, VALUELEN,            \
+        NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE           \
   }
 
-#define MAKE_NV_CS(NAME, VALUE)                                                \
-  {                                                                            \
-    (uint8_t *) NAME, (uint8_t *)VALUE, sizeof(NAME) - 1, strlen(VALUE),       \
-        NGHTTP2_NV_FLAG_NONE                                                   \
-  }
+struct loop_t;
+struct loop_io_t;
+struct loop_timer_t;
+
+typedef void (*loop_io_cb)(struct loop_t *loop, struct loop_io_t *io, uint32_t events);
+typedef void (*loop_timer_cb)(struct loop_t *loop, struct loop_timer_t *timer);
+
+/* an fd registered edge-triggered with the loop's epoll instance */
+struct loop_io_t {
+    int fd;
+    uint32_t events;
+    loop_io_cb cb;
+    void *data;
+};
+
+/* one-shot timer, kept in a slot of the loop's timer wheel */
+struct loop_timer_t {
+    uint64_t due;
+    loop_timer_cb cb;
+    void *data;
+    bool active;
+    /* the slot list the timer is on */
+    struct loop_timer_t **head;
+    struct loop_timer_t *prev;
+    struct loop_timer_t *next;
+};
+
+/*
+ * Single threaded reactor: an epoll instance, a hierarchical timer
+ * wheel, and a prepare hook run before every wait to flush work
+ * queued by the previous round of callbacks.
+ *
+ * Level 0 of the wheel has a slot per millisecond, every level above
+ * a slot per turn of the one below. A timer goes to the lowest level
+ * that reaches its due time and moves down a level each time the
+ * wheel gets to its slot, so starting and stopping are O(1) however
+ * many requests wait for a retry.
+ */
+struct loop_t {
+    int epfd;
+    bool stop;
+    uint64_t now;
+    /* wheel time: every slot before it has been run */
+    uint64_t tick;
+    struct loop_timer_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    /* non-empty slots, a bit per slot */
+    uint64_t occupied[WHEEL_LEVELS];
+    /* the slot being run, taken off the wheel first */
+    struct loop_timer_t *running;
+    size_t ntimers;
+    void (*prepare)(struct loop_t *loop, void *data);
+    void *prepare_data;
+};
+
+struct pool_t;
+struct connection_t;
+struct push_t;
+struct tenant_t;
+
+/*
+ * Token bucket for the requests of one apns-topic on one pool; |rate|
+ * 0 lets everything through. A 429 halves the rate, starting from what
+ * was sent over the last second if there was no limit, and successes
+ * bring it back up to |limit| (-topic-rate, 0: none).
+ */
+struct bucket_t {
+    struct bucket_t *next;
+    char *topic;
+    double limit;
+    double rate;
+    double tokens;
+    uint64_t last_us;
+    /* the rate last throttled from, and when */
+    double ceiling;
+    uint64_t throttled_us;
+    /* requests sent in the current second and in the one before */
+    uint64_t window_us;
+    uint32_t window_sent;
+    uint32_t last_sent;
+};
+
+/* -bench clock, shared by every pool */
+struct bench_t {
+    uint64_t start_us;
+    /* end of the warm-up, measuring starts */
+    uint64_t measure_us;
+    /* process CPU time at measure_us */
+    struct rusage usage;
+};
+
+/* growable byte buffer */
+struct buf_t {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * One request stream, the nghttp2 stream user data. Open streams are
+ * also linked on their connection so they can be found again when the
+ * connection goes away or a request is never sent. The callbacks only
+ * record into it; the result is written out when the stream is
+ * released.
+ */
+struct stream_t {
+    struct connection_t *conn;
+    int32_t stream_id;
+    char token[MAX_TOKEN_LEN];
+    const char *payload;
+    size_t payload_len;
+    /* the -daemon request this stream carries, NULL in batch modes */
+    struct push_t *push;
+    /* response */
+    int status;
+    char apns_id[64];
+    struct buf_t body;
+    /* what the plain text output prints for this stream */
+    struct buf_t text;
+    /* monotonic microseconds; with -bench -rate submit_us is when the
+       request was due, not when a stream slot was free */
+    uint64_t submit_us;
+    uint64_t header_us;
+    /* -bench warm-up request, left out of the statistics */
+    bool warmup;
+    /* times the request was sent again, the send rate it counts against,
+       and while waiting for the next try, its backoff timer */
+    int retries;
+    struct bucket_t *bucket;
+    struct loop_timer_t retry_timer;
+    /* times moved off a connection going away, and where in the
+       connection's output its last byte is (0: not all queued yet) */
+    int migrations;
+    uint64_t sent_pos;
+    struct stream_t *prev;
+    struct stream_t *next;
+    /* with -template the payload is rendered here, MAX_PAYLOAD_LEN */
+    char rendered[];
+};
 
 struct connection_t {
     int fd;
-    SSL_CTX *ssl_ctx;
+    struct loop_io_t io;
+    /* -timeout, or while |connecting| the deadline to be set up by */
+    struct loop_timer_t timer;
+    /* TCP or TLS setup under way, see connection_start() */
+    bool connecting;
+    struct dialer_t *dialer;
+    /* whose certificate the slot connects with, and which load of it */
+    struct tenant_t *tenant;
+    unsigned generation;
     SSL *ssl;
+    /* "host:port:sha256 of the client certificate", the session cache key */
+    char tls_key[SESSION_KEY_LEN];
     nghttp2_session *session;
     int want_io;
+    struct pool_t *pool;
+    int index;
+    uint32_t inflight;
+    struct stream_t *streams;
+    bool settings_received;
+    /* when the session was set up, for the SETTINGS round trip */
+    uint64_t open_us;
+    bool goaway;
+    /* with |goaway|, the last stream the server may have processed */
+    int32_t goaway_last_id;
+    /* -ping: next PING or the answer due, when the outstanding one was
+       sent (0: none) and the smoothed round trip (0: not known yet) */
+    struct loop_timer_t ping_timer;
+    uint64_t ping_sent_us;
+    uint64_t rtt_us;
+    bool closing;
+    bool dirty;
+    /* bytes queued for the network and bytes SSL_write() took */
+    uint64_t queued;
+    uint64_t written;
+    int reconnect_tries;
+    /* bytes of the DATA frame in send_data_callback() already written */
+    size_t data_frame_sent;
+    /*
+     * Frames are packed here and go to SSL_write() a record at a time.
+     * While |out_blocked| the buffer is mid-write and must be retried
+     * unchanged, so nothing is appended until it drains.
+     */
+    struct loop_timer_t flush_timer;
+    bool out_blocked;
+    size_t outlen;
+    uint8_t outbuf[OUTBUF_SIZE];
+};
+
+/*
+ * A -template payload, parsed once into literal text and {{field}}
+ * placeholders. Recipients come from -tokens as JSON lines with a
+ * "token" member, or as CSV with a header line naming the columns, one
+ * of them "token".
+ */
+struct template_seg_t {
+    /* literal text, or NULL for field |field| */
+    const char *lit;
+    size_t len;
+    int field;
+};
+
+struct template_t {
+    char *text;
+    struct template_seg_t segs[MAX_TEMPLATE_SEGS];
+    int nsegs;
+    char names[MAX_TEMPLATE_FIELDS][32];
+    int nfields;
+    bool csv;
+    /* CSV column of the token and of each field, -1 if absent */
+    int csv_token;
+    int csv_col[MAX_TEMPLATE_FIELDS];
+};
+
+/* one recipient's field values, pointing into its -tokens line */
+struct fields_t {
+    const char *token;
+    size_t token_len;
+    const char *v[MAX_TEMPLATE_FIELDS];
+    size_t len[MAX_TEMPLATE_FIELDS];
+    /* taken from JSON: already escaped, copied as they are */
+    bool escaped[MAX_TEMPLATE_FIELDS];
 };
 
 struct opt_t {
@@ -75,29 +426,638 @@ struct opt_t {
   uint16_t port;
   char *token;
   char *topic;
-  char *cert;
-  char *pkey;
+  /* -cert, repeatable, and the -pkey given after each */
+  char *certs[MAX_TENANTS];
+  char *pkeys[MAX_TENANTS];
+  int ncerts;
   char *prefix;
   char *payload;
+  size_t payload_len;
   char *message;
-  char *path;
+  char *tokens;
+  int connections;
+  int timeout;
+  int threads;
+  bool pin;
+  bool dedup;
+  int flush_delay;
+  char *daemon;
+  char *session_file;
+  char *dead_tokens;
+  /* -output file, -output-rotate size in MB, -output-full drop */
+  char *output;
+  int output_rotate;
+  bool output_drop;
+  char *p8;
+  char *key_id;
+  char *team_id;
+  int dns_ttl;
+  bool json;
+  bool stats;
+  int stats_interval;
+  uint64_t bench;
+  uint32_t concurrency;
+  double rate;
+  int warmup;
+  struct template_t *tpl;
+  int retries;
+  double topic_rate;
+  int ping;
+  /* :method and apns-topic, the same on every request */
+  nghttp2_nv headers[2];
 };
 
-struct loop_t {
-    int epfd;
+struct endpoint_t {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint64_t failed_until;
+};
+
+/* a socket connecting to one address of a dialer_t */
+struct dial_attempt_t {
+    struct loop_io_t io;
+    struct dialer_t *dialer;
+};
+
+/*
+ * A lookup waiting for the resolver thread of its host: |fd|, an
+ * eventfd, is written when the thread is done. |queued| and |done| are
+ * only touched under g_resolver.lock.
+ */
+struct resolve_wait_t {
+    int fd;
+    bool queued;
+    bool done;
+    struct resolve_wait_t *next;
+};
+
+/*
+ * A pool slot being connected: the host lookup, the race over its
+ * addresses, then the TLS handshake on the socket that won, all driven
+ * by the loop. |attempts| go with |addrs| by index, -1 fds when not
+ * running. Allocated on the first connect of a slot and reused after
+ * that, its eventfd with it.
+ */
+struct dialer_t {
+    struct connection_t *conn;
+    struct resolve_wait_t wait;
+    /* |wait.fd| in the loop while the lookup is under way */
+    struct loop_io_t wait_io;
+    struct endpoint_t addrs[MAX_RESOLVED_ADDRS];
+    int naddrs;
+    /* the next address to try, and sockets still connecting */
+    int next;
+    int pending;
+    struct dial_attempt_t attempts[MAX_RESOLVED_ADDRS];
+    /* starts the next address CONNECT_ATTEMPT_DELAY_MS after the last */
+    struct loop_timer_t attempt_timer;
+    uint64_t start_us;
+};
+
+/* resolved addresses of one host:port */
+struct resolve_entry_t {
+    char host[256];
+    uint16_t port;
+    struct endpoint_t addrs[MAX_RESOLVED_ADDRS];
+    int count;
+    /* rotates the first address tried, spreading connections out */
+    unsigned rotate;
+    uint64_t expires;
+    /* a resolver thread is running for the entry */
+    bool refreshing;
+    /* lookups waiting for it, while there are no addresses yet */
+    struct resolve_wait_t *waiters;
+    struct resolve_entry_t *next;
+};
+
+/*
+ * Process wide lookup cache. getaddrinfo() only runs on a background
+ * thread, one per host at a time: the first lookup of a host waits for
+ * it from the loop, an expired entry keeps being used while it is
+ * resolved again.
+ */
+struct resolver_t {
+    pthread_mutex_t lock;
+    struct resolve_entry_t *entries;
+    int ttl;
+};
+
+/* a signed provider token, ready to be sent as the authorization value */
+struct jwt_token_t {
+    char *value;
+    size_t len;
+    time_t iat;
+    struct jwt_token_t *prev;
+};
+
+/*
+ * Token based (.p8) auth. The JWT is signed once and shared by every
+ * stream and thread; jwt_refresh() replaces it when it gets old.
+ * Streams read |current| without locking, so replaced tokens are kept
+ * (on the |prev| chain) until exit.
+ */
+struct jwt_t {
+    EVP_PKEY *key;
+    const char *key_id;
+    const char *team_id;
+    pthread_mutex_t lock;
+    _Atomic(struct jwt_token_t *) current;
+};
+
+struct session_entry_t {
+    char key[SESSION_KEY_LEN];
+    SSL_SESSION *sessions[SESSION_CACHE_SLOTS];
+    int count;
+    struct session_entry_t *next;
+};
+
+/*
+ * Client side TLS session cache, shared by every connection and
+ * thread. TLS 1.3 tickets are meant for one use, so a session is taken
+ * out of the cache when offered; TLS 1.2 sessions are put back after
+ * each handshake that used them.
+ */
+struct session_cache_t {
+    pthread_mutex_t lock;
+    struct session_entry_t *entries;
+    uint64_t resumed;
+    uint64_t full;
+};
+
+/* a device token in binary, as the worker queues carry it */
+struct token_t {
+    uint8_t b[TOKEN_BIN_LEN];
+};
+
+/* -dead-tokens file: this header, then |slots| entries */
+struct dead_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t slots;
+    uint64_t count;
+    uint8_t reserved[32];
+};
+
+struct dead_entry_t {
+    struct token_t token;
+    /* when APNs last said the token is invalid, ms since the epoch; 0
+       marks a free slot */
+    _Atomic uint64_t since_ms;
+};
+
+/* one mapping of the store; a grown store replaces it */
+struct dead_table_t {
+    int fd;
+    size_t size;
+    struct dead_header_t *hdr;
+    struct dead_entry_t *entries;
+    uint64_t mask;
+    struct dead_table_t *prev;
+};
+
+/*
+ * -dead-tokens: the tokens APNs answered 410 or BadDeviceToken for, a
+ * linear probing hash set in a mapped file that outlives the run. Every
+ * thread looks tokens up without locking; adding one takes |lock|.
+ */
+struct dead_store_t {
+    pthread_mutex_t lock;
+    const char *path;
+    _Atomic(struct dead_table_t *) table;
+    bool full;
+};
+
+/*
+ * -dedup: tokens already read in this run, open addressing over the
+ * binary tokens themselves. An all-zero slot is free, so the all-zero
+ * token is kept aside in |zero|.
+ */
+struct token_set_t {
+    struct token_t *slots;
+    uint64_t mask;
+    uint64_t count;
+    bool zero;
+};
+
+/*
+ * One client certificate, or with -p8 none, and the app it pushes
+ * for. The certificate and key are read once into an SSL_CTX that all
+ * the tenant's connections, on every thread, share. SIGHUP reloads
+ * them (with -daemon, the only mode that runs long enough to care);
+ * connections made before keep their context until they close.
+ */
+struct tenant_t {
+    int index;
+    const char *cert;
+    const char *pkey;
+    /* the certificate's UID: the apns-topic it is for (and .voip etc.) */
+    char *topic;
+    time_t not_after;
+    /* "host:port:sha256 of the certificate", the session cache key */
+    char tls_key[SESSION_KEY_LEN];
+    SSL_CTX *ctx;
+    /* bumped by a reload that changed the certificate */
+    unsigned generation;
+};
+
+/* |lock| covers |ctx|, |tls_key| and |generation| against reloads */
+struct tenants_t {
+    pthread_mutex_t lock;
+    const struct opt_t *opt;
+    struct tenant_t list[MAX_TENANTS];
+    int count;
+    /* requests without an apns-topic of their own go here */
+    struct tenant_t *dflt;
+};
+
+/*
+ * -tokens input: a mapped file with the offset of the next line, or a
+ * stream read into |line|.
+ */
+struct input_t {
+    const char *map;
+    size_t size;
+    size_t pos;
+    FILE *fp;
+    char line[MAX_RECIPIENT_LEN];
+};
+
+/*
+ * Bounded single-producer/single-consumer ring of |stride| byte items.
+ * The producer only writes |tail|, the consumer only writes |head|;
+ * each sits on its own cache line so the two threads never share a
+ * written line.
+ */
+struct spsc_ring_t {
+    _Alignas(CACHELINE_SIZE) atomic_size_t head;
+    _Alignas(CACHELINE_SIZE) atomic_size_t tail;
+    _Alignas(CACHELINE_SIZE) size_t mask;
+    size_t stride;
+    uint8_t *items;
+};
+
+/*
+ * Hand-off between the reader thread and the workers. When every
+ * worker queue is full the reader sets |waiting| and sleeps on
+ * |space_fd|; workers kick it after consuming.
+ */
+struct feeder_t {
+    atomic_bool waiting;
+    int space_fd;
+};
+
+struct worker_t;
+struct daemon_t;
+
+/*
+ * Source of device tokens for one run: either the single -token from
+ * the command line, one token per line from the -tokens file/stdin,
+ * for a worker thread, its queue fed by the reader thread, or the
+ * requests queued by -daemon clients.
+ */
+struct batch_t {
+    const struct opt_t *opt;
+    struct input_t *in;
+    struct worker_t *worker;
+    struct daemon_t *daemon;
+    bool eof;
+    /* every connection was lost before the input ran out */
+    bool stranded;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t failed;
+    /* requests sent again after a retryable failure */
+    uint64_t retried;
+    /* requests moved to another connection, unseen by the server */
+    uint64_t migrated;
+    /* tokens not pushed to since -dead-tokens has them */
+    uint64_t skipped;
+    /* -dedup: tokens read so far, and repeats of them dropped */
+    struct token_set_t *seen;
+    uint64_t duplicates;
+    /* -bench share of this batch: requests after warm-up, streams in
+       flight (0: what the server allows), requests per second (0: as
+       fast as streams free up) */
+    uint64_t bench_count;
+    uint32_t bench_concurrency;
+    double bench_rate;
+    /* requests generated so far, warm-up included, and after warm-up */
+    uint64_t bench_sent;
+    uint64_t bench_measured;
+};
+
+/*
+ * Bytes from one pool to the output thread: whole results only, a
+ * chunk at a time. |head| and |tail| count bytes ever consumed and
+ * produced; each is written by one side only, on its own cache line.
+ * With -output-full block a pool that finds the ring full sets
+ * |waiting| and sleeps on |space_fd| until the output thread kicks it.
+ */
+struct sink_ring_t {
+    _Alignas(CACHELINE_SIZE) atomic_size_t head;
+    _Alignas(CACHELINE_SIZE) atomic_size_t tail;
+    _Alignas(CACHELINE_SIZE) uint8_t *data;
+    size_t size;
+    atomic_bool waiting;
+    int space_fd;
+    /* results dropped with -output-full drop, only touched by the pool */
+    uint64_t dropped;
+};
+
+/*
+ * The output thread: gathers what the pools queued and writes it to
+ * stdout or -output with one writev() per round, so a slow pipe or
+ * disk holds up this thread rather than the event loops.
+ */
+struct sink_t {
+    pthread_t thread;
+    struct sink_ring_t *rings;
+    int nrings;
+    /* set by a pool that queued output while the thread may sleep */
+    atomic_bool notified;
+    atomic_bool stop;
+    /* the thread runs; |closed| once sink_close() took it down */
+    bool started;
+    atomic_bool closed;
+    int wake_fd;
+    bool drop;
+    /* -output file (NULL: stdout), its size and -output-rotate limit */
+    const char *path;
+    int fd;
+    uint64_t written;
+    uint64_t rotate;
+    bool failed;
+};
+
+/* results of one pool, collected during an event loop round */
+struct writer_t {
+    struct buf_t buf;
+    uint64_t records;
+    struct sink_ring_t *ring;
+};
+
+/* log-linear histogram of microsecond values, HDR style */
+struct hist_t {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/*
+ * Size class free lists for the memory of one pool: nghttp2's, through
+ * nghttp2_mem, and the streams. A pool only ever runs on one thread,
+ * so nothing here is locked, and blocks freed by finished streams are
+ * handed to the next ones instead of going back to malloc.
+ */
+struct mem_block_t {
+    struct mem_block_t *next;
+};
+
+struct mem_pool_t {
+    struct mem_block_t *free[MEM_CLASSES];
+    size_t nfree[MEM_CLASSES];
+    /* released streams, all of the same size within a run */
+    struct stream_t *streams;
+    size_t nstreams;
+    nghttp2_mem hooks;
+};
+
+/* counters summed over every connection of a run */
+struct pool_stats_t {
+    uint64_t reconnects;
+    uint64_t ssl_writes;
+    /* TLS application data records actually sent, see ssl_record_cb() */
+    uint64_t records;
+    uint64_t bytes_out;
+    uint64_t completed;
+    /*
+     * Request HEADERS frames and their size with frame header. With
+     * -stats, |encode_ns| is the time nghttp2_session_send() took apart
+     * from the |write_ns| spent in SSL_write(): HPACK and framing.
+     */
+    uint64_t headers;
+    uint64_t header_bytes;
+    uint64_t encode_ns;
+    uint64_t write_ns;
+    struct hist_t hist[PHASE_MAX];
+};
+
+/*
+ * A fixed number of connection slots to the same host. New streams go
+ * to the connection with the most free stream slots; a slot whose
+ * connection died is reconnected lazily the next time work is
+ * dispatched to the pool. Every -cert tenant has slots of its own.
+ */
+struct pool_t {
+    const struct opt_t *opt;
+    struct batch_t *batch;
+    struct loop_t *loop;
+    struct connection_t *conns;
+    /* |size| slots, of which |target| are kept connected; the others
+       take over while a connection that received GOAWAY drains */
+    int size;
+    int target;
+    struct pool_stats_t stats;
+    struct writer_t out;
+    struct mem_pool_t mem;
+    /* re-checks the provider token with -p8 */
+    struct loop_timer_t auth_timer;
+    /* -stats-interval reports, |last| is the previous report's snapshot */
+    struct loop_timer_t stats_timer;
+    struct pool_stats_t last;
+    /* -bench -rate: wakes the pool when the next request is due */
+    struct loop_timer_t bench_timer;
+    /* per topic send rates, and the wakeup when they hold requests back */
+    struct bucket_t *buckets;
+    struct loop_timer_t rate_timer;
+    /* streams waiting out their backoff, and those due to be sent again */
+    uint32_t retrying;
+    struct stream_t *ready;
+    struct stream_t *ready_tail;
+    uint64_t rng;
+    /* -threads worker index, -1 when the pool runs on the main thread */
+    int worker;
+    /* a certificate was reloaded and connections made before remain */
+    bool retiring;
+    /* blocking_post() took over: connections coming up get requests */
+    bool running;
+};
+
+/*
+ * One -threads worker: its own event loop, connection pool and token
+ * queue. Nothing here is touched by other threads except the queue,
+ * the wakeup eventfd and the flags.
+ */
+struct worker_t {
+    int index;
+    int cpu;
+    pthread_t thread;
+    struct loop_t loop;
+    struct pool_t pool;
+    struct batch_t batch;
+    struct spsc_ring_t ring;
+    struct feeder_t *feeder;
+    int wake_fd;
+    struct loop_io_t wake_io;
+    atomic_bool notified;
+    atomic_bool input_done;
+    /* the worker gave up (no usable connection left): feed it no more */
+    atomic_bool gone;
+    /* the item last taken off |ring|, as text */
+    char line[MAX_RECIPIENT_LEN];
+};
+
+/* a process connected to the -daemon socket */
+struct client_t {
+    int fd;
+    struct loop_io_t io;
+    struct daemon_t *daemon;
+    struct buf_t in;
+    struct buf_t out;
+    /* requests not answered yet; the client is freed once closed and 0 */
+    uint32_t pending;
+    /* the client has finished sending */
+    bool eof;
+    bool closed;
+};
+
+/* one request received on the -daemon socket */
+struct push_t {
+    struct push_t *next;
+    struct client_t *client;
+    /* the request's "id" as raw JSON, echoed back verbatim */
+    char *id;
+    char *token;
+    char *payload;
+    size_t payload_len;
+    nghttp2_nv headers[MAX_PUSH_HEADERS];
+    size_t nheaders;
+};
+
+/*
+ * -daemon mode: the pool stays connected and takes push requests,
+ * one JSON object per line, from clients of a Unix domain socket.
+ * Each request is answered with one JSON line once its stream closes.
+ */
+struct daemon_t {
+    const char *path;
+    int fd;
+    struct loop_io_t io;
+    int signal_fd;
+    struct loop_io_t signal_io;
+    struct pool_t *pool;
+    /* received, waiting for a free stream slot */
+    struct push_t *head;
+    struct push_t *tail;
+    bool draining;
 };
 
 static int g_debug_flag = 0;
 
+static struct session_cache_t g_session_cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+static struct dead_store_t g_dead = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, false };
+static struct tenants_t g_tenants = { PTHREAD_MUTEX_INITIALIZER, NULL, { { 0 } }, 0, NULL };
+
+static struct jwt_t g_jwt = { NULL, NULL, NULL, PTHREAD_MUTEX_INITIALIZER, NULL };
+
+static struct resolver_t g_resolver = { PTHREAD_MUTEX_INITIALIZER, NULL, DEFAULT_DNS_TTL };
+
+static pthread_mutex_t g_output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sink_t g_sink;
+
+static struct bench_t g_bench;
+
 #define debug  if(g_debug_flag) printf
 
 static char*
 alloc_string(const char* s);
 
+static void
+pool_dispatch(struct pool_t *pool);
+
+static void
+pool_check_done(struct pool_t *pool);
+
+static bool
+stream_retryable(const struct stream_t *st, uint32_t error_code);
+
+static void
+stream_retry(struct stream_t *st);
+
+static bool
+stream_migrate(struct stream_t *st);
+
+static void
+pool_refill(struct pool_t *pool, struct tenant_t *tenant);
+
+static void
+connection_ping_ack(struct connection_t *conn, const uint8_t *opaque);
+
+static void
+bucket_ok(struct bucket_t *b);
+
+static bool
+connection_start(struct connection_t *conn);
+
+static void
+connection_cleanup(struct connection_t *conn);
+
+static void
+connection_io_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events);
+
+static void
+loop_timer_start(struct loop_t *loop, struct loop_timer_t *timer, uint64_t after_ms,
+                 loop_timer_cb cb, void *data);
+
+static void
+loop_timer_stop(struct loop_t *loop, struct loop_timer_t *timer);
+
+static void
+connection_flush_cb(struct loop_t *loop, struct loop_timer_t *timer);
+
+static void
+stream_release(struct stream_t *st, const char *error);
+
+static void
+stream_note_dead(const struct stream_t *st);
+
+static void
+stream_record_header(struct stream_t *st, const uint8_t *name, size_t namelen,
+                     const uint8_t *value, size_t valuelen);
+
+static void
+daemon_reply(struct push_t *push, const struct stream_t *st, const char *error);
+
+static bool
+string_eq(const char* a, const char *b);
+
+static uint64_t
+monotonic_ms();
+
+static int
+helper_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg);
+
+static uint64_t
+monotonic_us();
+
+static uint64_t
+monotonic_ns();
+
+static struct push_t*
+daemon_next_push(struct daemon_t *d);
+
+static void
+sink_stop();
+
+/* results the output thread still holds are written out first */
 static void
 die(const char *msg)
 {
     fprintf(stderr, "FATAL: %s\n", msg);
+    sink_stop();
     exit(EXIT_FAILURE);
 }
 
@@ -105,6 +1065,7 @@ static void
 diec(const char *msg,int i)
 {
     fprintf(stderr, "FATAL: %s %d\n", msg,i);
+    sink_stop();
     exit(EXIT_FAILURE);
 }
 
@@ -114,375 +1075,2538 @@ file_exsit(const char *f)
     return 0 == access(f, 0) ? true : (fprintf(stderr,"file not exsit: %s\n",f),false);
 }
 
-static char*
-make_path(const char *prefix, const char *token)
+static bool
+buf_reserve(struct buf_t *b, size_t n)
+{
+    size_t cap = b->cap ? b->cap : 256;
+    char *p;
+
+    if (b->len + n <= b->cap) {
+        return true;
+    }
+    while (cap < b->len + n) {
+        cap *= 2;
+    }
+    p = realloc(b->data, cap);
+    if (p == NULL) {
+        return false;
+    }
+    b->data = p;
+    b->cap = cap;
+    return true;
+}
+
+static bool
+buf_append(struct buf_t *b, const void *data, size_t n)
+{
+    if (!buf_reserve(b, n)) {
+        return false;
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+    return true;
+}
+
+static bool
+buf_puts(struct buf_t *b, const char *s)
 {
-    char *path = malloc(strlen(prefix)+strlen(token)+1);
-    memset(path,0,strlen(prefix)+strlen(token)+1);
-    strcat(path,prefix);
-    strcat(path,token);
-    return path;
+    return buf_append(b, s, strlen(s));
 }
 
+/* drop the first |n| bytes */
 static void
-init_global_library()
+buf_consume(struct buf_t *b, size_t n)
 {
-    SSL_library_init();
-    SSL_load_error_strings();
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
 }
 
-static int
-connect_to_url(const char *url, uint16_t port)
+static void
+buf_free(struct buf_t *b)
 {
-    int sockfd;
-    int rv;
-    struct addrinfo hints, *res, *ressave;
-    char port_str[6];
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
 
-    bzero(&hints, sizeof(struct addrinfo));
-    bzero(port_str, sizeof(port_str));
-    snprintf(port_str, 6, "%d", port);
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
+/* append |s| as a quoted JSON string */
+static bool
+buf_json_string(struct buf_t *b, const char *s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
 
-    debug("ns looking up ...\n");
-    rv = getaddrinfo(url, port_str, &hints, &res);
-    if (rv != 0) {
-        freeaddrinfo(res);
-        return -1;
+    if (!buf_reserve(b, n * 6 + 2)) {
+        return false;
     }
-
-    ressave = res;
-    do {
-        sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if(sockfd < 0) {
-            continue;
-        }
-        struct in_addr a = ((struct sockaddr_in*)res->ai_addr)->sin_addr;
-        const char *p = inet_ntoa(a);
-        debug("connecting to : %s\n",p);
-        while ((rv = connect(sockfd, res->ai_addr, res->ai_addrlen)) == -1 &&
-                errno == EINTR)
-            ;
-        if (0 == rv) {
-            freeaddrinfo(ressave);
-            return sockfd;
+    b->data[b->len++] = '"';
+    for (i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            b->data[b->len++] = '\\';
+            b->data[b->len++] = (char)c;
+        } else if (c < 0x20) {
+            memcpy(b->data + b->len, "\\u00", 4);
+            b->data[b->len + 4] = hex[c >> 4];
+            b->data[b->len + 5] = hex[c & 15];
+            b->len += 6;
         } else {
-            close(sockfd);
+            b->data[b->len++] = (char)c;
         }
-    } while ((res = res->ai_next) != NULL);
-
-    freeaddrinfo(ressave);
-    return -1;
+    }
+    b->data[b->len++] = '"';
+    return true;
 }
 
-static bool
-socket_connect(const char *url, uint16_t port, struct connection_t *conn)
+static size_t
+hist_index(uint64_t v)
 {
-    int fd;
-    fd = connect_to_url(url,port);
-    if (fd > 0) {
-        conn->fd = fd;
-        debug("socket connect ok: fd=%d, host: %s:%d\n", conn->fd, url, port);
-        return true;
+    int shift;
+
+    if (v >= (1ULL << HIST_MAX_BITS)) {
+        v = (1ULL << HIST_MAX_BITS) - 1;
     }
-    die("socket connect fail.");
-    return false;
+    if (v < (2U << HIST_SUB_BITS)) {
+        return (size_t)v;
+    }
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((size_t)shift << HIST_SUB_BITS) + (size_t)(v >> shift);
 }
 
-static X509*
-read_x509_certificate(const char* path)
+/* the highest value that falls into bucket |i| */
+static uint64_t
+hist_value(size_t i)
 {
-    BIO  *bio = NULL;
-    X509 *x509 = NULL;
-    if (NULL == (bio = BIO_new_file(path, "r"))) {
-        return NULL;
+    int shift;
+
+    if (i < (2U << HIST_SUB_BITS)) {
+        return i;
     }
-    x509 = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
-    BIO_free(bio);
-    return x509;
+    shift = (int)(i >> HIST_SUB_BITS) - 1;
+    return ((uint64_t)(i - ((size_t)shift << HIST_SUB_BITS) + 1) << shift) - 1;
 }
 
-static char*
-get_topic (const char* path)
+static void
+hist_record(struct hist_t *h, uint64_t v)
 {
-  X509 *x509 = NULL;
-  if (NULL == (x509 = read_x509_certificate(path))) {
-      die("read_x509_certificate fail.");
-  }
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
 
-  const char* nb = (char*)X509_get_notBefore(x509)->data;
-  const char* na = (char*)X509_get_notAfter(x509)->data;
-  debug("notBefore : %s\nnotAfter  : %s\n", nb, na);
+static void
+hist_add(struct hist_t *dst, const struct hist_t *src)
+{
+    size_t i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
 
-  X509_NAME *xn = NULL;
-  ASN1_STRING *d = NULL;
+/*
+ * |h| minus an earlier snapshot of itself. The exact maximum is lost,
+ * the result carries the upper bound of its highest bucket.
+ */
+static void
+hist_since(struct hist_t *dst, const struct hist_t *h, const struct hist_t *then)
+{
+    size_t i;
 
-  int cnt = 0, pos = -1;
-  xn = X509_get_subject_name(x509);
-  cnt = X509_NAME_entry_count(xn);
+    dst->count = h->count - then->count;
+    dst->max = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] = h->buckets[i] - then->buckets[i];
+        if (dst->buckets[i]) {
+            dst->max = hist_value(i);
+        }
+    }
+}
 
-  pos = X509_NAME_get_index_by_NID(xn, NID_userId, -1);
-  if (pos >=0 && pos <= cnt) {
-      d = X509_NAME_ENTRY_get_data(X509_NAME_get_entry(xn, pos));
-      debug("%s = %s [%d]\n", SN_userId, d->data, d->length);
-      return alloc_string((char*)d->data);
-  }
+/* the value at or below which a |q| fraction of the samples lie */
+static uint64_t
+hist_percentile(const struct hist_t *h, double q)
+{
+    uint64_t want = (uint64_t)(q * (double)h->count + 0.999999);
+    uint64_t seen = 0;
+    size_t i;
 
-  die("get topic not done ");
-  return NULL;
+    if (want == 0) {
+        want = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+        }
+    }
+    return h->max;
 }
 
-/*
- * Callback function for TLS NPN. Since this program only supports
- * HTTP/2 protocol, if server does not offer HTTP/2 the nghttp2
- * library supports, we terminate program.
- */
+/* in front of every block, keeps it 16 byte aligned */
+struct mem_hdr_t {
+    size_t cls;
+    size_t size;
+};
+
 static int
-select_next_proto_cb(SSL *ssl, unsigned char **out,
-                     unsigned char *outlen, const unsigned char *in,
-                     unsigned int inlen, void *arg)
+mem_class(size_t size)
 {
-    int rv;
-  /* nghttp2_select_next_protocol() selects HTTP/2 protocol the
-     nghttp2 library supports. */
-    rv = nghttp2_select_next_protocol(out, outlen, in, inlen);
-    if (rv <= 0) {
-        die("Server did not advertise HTTP/2 protocol");
+    int c = 0;
+    while (c < MEM_CLASSES && ((size_t)1 << (c + MEM_MIN_SHIFT)) < size) {
+        c++;
     }
-    return SSL_TLSEXT_ERR_OK;
+    return c;
 }
 
-static void
-init_ssl_ctx(SSL_CTX *ssl_ctx)
+static void*
+mem_malloc(size_t size, void *mem_user_data)
 {
-  /* Disable SSLv2 and enable all workarounds for buggy servers */
-    SSL_CTX_set_options(ssl_ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2);
-    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
-    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
-  /* Set NPN callback */
-    SSL_CTX_set_next_proto_select_cb(ssl_ctx, select_next_proto_cb, NULL);
+    struct mem_pool_t *m = mem_user_data;
+    int c = mem_class(size);
+    struct mem_hdr_t *h;
+
+    if (c < MEM_CLASSES && m->free[c]) {
+        h = (struct mem_hdr_t *)m->free[c];
+        m->free[c] = m->free[c]->next;
+        m->nfree[c]--;
+    } else {
+        h = malloc(sizeof(*h) + (c < MEM_CLASSES ? (size_t)1 << (c + MEM_MIN_SHIFT) : size));
+        if (h == NULL) {
+            return NULL;
+        }
+    }
+    h->cls = (size_t)c;
+    h->size = size;
+    return h + 1;
 }
 
-static bool
-ssl_allocate(struct connection_t *conn, const char *cert, const char *pkey)
+static void
+mem_free(void *ptr, void *mem_user_data)
 {
-    int rv;
-    X509 *x509 = NULL;
-    SSL_CTX *ssl_ctx = NULL;
-    SSL *ssl = NULL;
+    struct mem_pool_t *m = mem_user_data;
+    struct mem_hdr_t *h;
+    struct mem_block_t *b;
+    size_t c;
 
-    if (NULL == (x509 = read_x509_certificate(cert))) {
-        return false;
+    if (ptr == NULL) {
+        return;
     }
-
-    ssl_ctx = SSL_CTX_new(SSLv23_client_method());
-    if (ssl_ctx == NULL) {
-        X509_free(x509);
+    h = (struct mem_hdr_t *)ptr - 1;
+    c = h->cls;
+    if (c < MEM_CLASSES &&
+        (m->nfree[c] + 1) << (c + MEM_MIN_SHIFT) <= MEM_CACHE_BYTES) {
+        /* the block's header becomes the free list link */
+        b = (struct mem_block_t *)h;
+        b->next = m->free[c];
+        m->free[c] = b;
+        m->nfree[c]++;
+        return;
     }
-    init_ssl_ctx(ssl_ctx);
+    free(h);
+}
 
-    rv = SSL_CTX_use_certificate(ssl_ctx, x509);
-    X509_free(x509);
-    if (rv != 1) {
-        SSL_CTX_free(ssl_ctx);
-        return false;
-    }
+static void*
+mem_calloc(size_t nmemb, size_t size, void *mem_user_data)
+{
+    void *p;
 
-    rv = SSL_CTX_use_PrivateKey_file(ssl_ctx, cert, SSL_FILETYPE_PEM);
-    if (rv != 1) {
-        SSL_CTX_free(ssl_ctx);
-        return false;
+    if (size && nmemb > SIZE_MAX / size) {
+        return NULL;
     }
-
-    rv = SSL_CTX_check_private_key(ssl_ctx);
-    if (rv != 1) {
-        SSL_CTX_free(ssl_ctx);
-        return false;
+    if ((p = mem_malloc(nmemb * size, mem_user_data)) != NULL) {
+        memset(p, 0, nmemb * size);
     }
+    return p;
+}
 
-    ssl = SSL_new(ssl_ctx);
-    if (ssl == NULL) {
-        SSL_CTX_free(ssl_ctx);
-        return false;
+static void*
+mem_realloc(void *ptr, size_t size, void *mem_user_data)
+{
+    struct mem_hdr_t *h;
+    size_t cap;
+    void *p;
+
+    if (ptr == NULL) {
+        return mem_malloc(size, mem_user_data);
+    }
+    h = (struct mem_hdr_t *)ptr - 1;
+    cap = h->cls < MEM_CLASSES ? (size_t)1 << (h->cls + MEM_MIN_SHIFT) : h->size;
+    if (size <= cap) {
+        h->size = size;
+        return ptr;
+    }
+    if ((p = mem_malloc(size, mem_user_data)) == NULL) {
+        return NULL;
     }
+    memcpy(p, ptr, h->size);
+    mem_free(ptr, mem_user_data);
+    return p;
+}
 
-    conn->ssl_ctx = ssl_ctx;
-    conn->ssl = ssl;
-    return true;
+static void
+mem_pool_init(struct mem_pool_t *m)
+{
+    bzero(m, sizeof(*m));
+    m->hooks.mem_user_data = m;
+    m->hooks.malloc = mem_malloc;
+    m->hooks.free = mem_free;
+    m->hooks.calloc = mem_calloc;
+    m->hooks.realloc = mem_realloc;
 }
 
-static bool
-ssl_handshake(SSL *ssl, int fd)
+/*
+ * Just enough JSON for the -daemon protocol: walk the members of one
+ * object and decode string values. Nested values are skipped as raw
+ * spans, so an object payload can be passed on without re-encoding.
+ */
+static const char*
+json_ws(const char *p, const char *e)
 {
-    int rv;
-    if (SSL_set_fd(ssl, fd) == 0) {
-        return false;
+    while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
     }
-    ERR_clear_error();
-    //rv = SSL_connect(ssl);
-    SSL_set_connect_state(ssl);
-    rv = SSL_do_handshake(ssl);
+    return p;
+}
 
-    if(rv==1) {
-            debug("Connected with encryption: %s\n", SSL_get_cipher(ssl));
-    }
-    if (rv <= 0) {
-	debug("rv = %d\n",rv);
-	unsigned long ssl_err = SSL_get_error(ssl,rv);
-	int geterror = ERR_peek_error();
-	int reason = ERR_GET_REASON(geterror);
-	debug("rv %d, ssl_error %lu, get_err %d, reason %d \n",rv, ssl_err, geterror ,reason);
-	debug("errmsg: %s\n", ERR_error_string(ERR_get_error(), NULL));
-	debug("errmsg msg: %s\n", ERR_reason_error_string(ERR_peek_error()));
-	debug("Error: %s\n", ERR_reason_error_string(ERR_get_error()));
-	    switch(reason)
-	    {
-	        case SSL_R_SSLV3_ALERT_CERTIFICATE_EXPIRED: /*,define in <openssl/ssl.h> "sslv3 alert certificate expired"},*/
-	          reason = X509_V_ERR_CERT_HAS_EXPIRED;
-	            printf("X509_V_ERR_CERT_HAS_EXPIRED\n");
-	            break;
-	        case SSL_R_SSLV3_ALERT_CERTIFICATE_REVOKED: /*,"sslv3 alert certificate revoked"},*/
-	          reason = X509_V_ERR_CERT_REVOKED;
-	            printf("X509_V_ERR_CERT_REVOKED\n");
-	            break;
-	    }
+/*
+ * End of the JSON value starting at |p|, or NULL if it is malformed.
+ * A \u0000 escape counts as malformed: decoded, it would cut the C
+ * string of a token, topic or header short.
+ */
+static const char*
+json_skip(const char *p, const char *e)
+{
+    int depth = 0;
 
-        fprintf(stderr, "%s\n", ERR_error_string(ERR_get_error(), NULL));
-        return false;
+    if (p >= e) {
+        return NULL;
     }
-    return true;
+    if (*p != '"' && *p != '{' && *p != '[') {
+        const char *b = p;
+        while (p < e && *p != ',' && *p != '}' && *p != ']' &&
+               *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+            p++;
+        }
+        return p > b ? p : NULL;
+    }
+    do {
+        if (*p == '"') {
+            for (p++; p < e && *p != '"'; p++) {
+                if (*p == '\\') {
+                    if (e - p > 5 && p[1] == 'u' && memcmp(p + 2, "0000", 4) == 0) {
+                        return NULL;
+                    }
+                    p++;
+                }
+            }
+            if (p >= e) {
+                return NULL;
+            }
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            depth--;
+        }
+        p++;
+    } while (depth > 0 && p < e);
+    return depth == 0 ? p : NULL;
 }
 
-static bool
-ssl_connect(const char *cert, const char *pkey, struct connection_t *conn)
+static int
+json_hex4(const char *p)
 {
-    if (ssl_allocate(conn, cert, pkey)) {
-        debug("ssl allocation ok\n");
-    } else {
-        fprintf(stderr, "ssl allocation error\n");
-        return false;
-    }
-
-    debug("ssl handshaking ...\n");
-    if (ssl_handshake(conn->ssl, conn->fd)) {
-	debug("ssl handshake ok\n");
-    } else {
-        fprintf(stderr, "ssl handshake error\n");
-        return false;
+    int i, v = 0;
+    for (i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
     }
-
-    return true;
+    return v;
 }
 
-// callback impelement
-#define _U_
 /*
- * The implementation of nghttp2_send_callback type. Here we write
- * |data| with size |length| to the network and return the number of
- * bytes actually written. See the documentation of
- * nghttp2_send_callback for the details.
+ * Decode the JSON string at [p, e) into a NUL terminated malloc'ed
+ * copy. Returns NULL if it is not a well formed string.
  */
-static ssize_t send_callback(nghttp2_session *session _U_, const uint8_t *data,
-                             size_t length, int flags _U_, void *user_data) {
+static char*
+json_string(const char *p, const char *e, size_t *len)
+{
+    struct buf_t b = { NULL, 0, 0 };
+    char c;
 
-  int rv;
-  struct connection_t *conn = user_data;
-  conn->want_io = IO_NONE;
-  ERR_clear_error();
-  rv = SSL_write(conn->ssl, data, (int)length);
-  if (rv <= 0) {
-    int err = SSL_get_error(conn->ssl, rv);
-    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
-      conn->want_io =
-          (err == SSL_ERROR_WANT_READ ? WANT_READ : WANT_WRITE);
-      rv = NGHTTP2_ERR_WOULDBLOCK;
-    } else {
-      rv = NGHTTP2_ERR_CALLBACK_FAILURE;
+    if (e - p < 2 || *p != '"' || e[-1] != '"' || !buf_reserve(&b, (size_t)(e - p))) {
+        return NULL;
     }
-  }
-  return rv;
+    for (p++, e--; p < e; p++) {
+        if (*p != '\\') {
+            b.data[b.len++] = *p;
+            continue;
+        }
+        if (++p == e) {
+            break;
+        }
+        switch (*p) {
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'u': {
+            int u = e - p > 4 ? json_hex4(p + 1) : -1;
+            /* no NUL inside a C string */
+            if (u <= 0) {
+                buf_free(&b);
+                return NULL;
+            }
+            p += 4;
+            /* BMP only; a surrogate pair is kept as two 3 byte sequences */
+            if (u < 0x80) {
+                b.data[b.len++] = (char)u;
+            } else if (u < 0x800) {
+                b.data[b.len++] = (char)(0xc0 | (u >> 6));
+                b.data[b.len++] = (char)(0x80 | (u & 0x3f));
+            } else {
+                b.data[b.len++] = (char)(0xe0 | (u >> 12));
+                b.data[b.len++] = (char)(0x80 | ((u >> 6) & 0x3f));
+                b.data[b.len++] = (char)(0x80 | (u & 0x3f));
+            }
+            continue;
+        }
+        default: c = *p; break;
+        }
+        b.data[b.len++] = c;
+    }
+    if (len) {
+        *len = b.len;
+    }
+    b.data[b.len] = 0;
+    return b.data;
 }
 
 /*
- * The implementation of nghttp2_recv_callback type. Here we read data
- * from the network and write them in |buf|. The capacity of |buf| is
- * |length| bytes. Returns the number of bytes stored in |buf|. See
- * the documentation of nghttp2_recv_callback for the details.
+ * Step to the next member of the object whose body |*p| points into
+ * (just after '{' for the first call). Sets |key| to the decoded name
+ * and [*v, *ve) to the raw value. Returns 1 for a member, 0 at the
+ * closing brace and -1 on malformed input.
  */
-static ssize_t recv_callback(nghttp2_session *session _U_, uint8_t *buf,
-                             size_t length, int flags _U_, void *user_data) {
+static int
+json_next_member(const char **p, const char *e, char *key, size_t keysize,
+                 const char **v, const char **ve)
+{
+    const char *q = json_ws(*p, e);
+    const char *ke;
+    char *k;
 
-  struct connection_t *conn;
-  int rv;
-  conn = (struct connection_t *)user_data;
-  conn->want_io = IO_NONE;
-  ERR_clear_error();
-  rv = SSL_read(conn->ssl, buf, (int)length);
-  if (rv < 0) {
-    int err = SSL_get_error(conn->ssl, rv);
-    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
-      conn->want_io =
-          (err == SSL_ERROR_WANT_READ ? WANT_READ : WANT_WRITE);
-      rv = NGHTTP2_ERR_WOULDBLOCK;
+    if (q < e && *q == ',') {
+        q = json_ws(q + 1, e);
+    }
+    if (q < e && *q == '}') {
+        *p = q + 1;
+        return 0;
+    }
+    if (q >= e || *q != '"' || (ke = json_skip(q, e)) == NULL) {
+        return -1;
+    }
+    if (memchr(q + 1, '\\', (size_t)(ke - q - 2)) == NULL) {
+        /* nothing to decode, the usual case */
+        snprintf(key, keysize, "%.*s", (int)(ke - q - 2), q + 1);
     } else {
-      rv = NGHTTP2_ERR_CALLBACK_FAILURE;
+        if ((k = json_string(q, ke, NULL)) == NULL) {
+            return -1;
+        }
+        snprintf(key, keysize, "%s", k);
+        free(k);
     }
-  } else if (rv == 0) {
-    rv = NGHTTP2_ERR_EOF;
-  }
-  return rv;
+    q = json_ws(ke, e);
+    if (q >= e || *q != ':') {
+        return -1;
+    }
+    *v = json_ws(q + 1, e);
+    if ((*ve = json_skip(*v, e)) == NULL) {
+        return -1;
+    }
+    *p = *ve;
+    return 1;
 }
 
-static int on_frame_send_callback(nghttp2_session *session,
-                                  const nghttp2_frame *frame,
-                                  void *user_data _U_) {
-  size_t i;
-  switch (frame->hd.type) {
-  case NGHTTP2_HEADERS:
-    if (nghttp2_session_get_stream_user_data(session, frame->hd.stream_id)) {
-      const nghttp2_nv *nva = frame->headers.nva;
-      debug("[INFO] C ----------------------------> S (HEADERS)\n");
-      for (i = 0; i < frame->headers.nvlen; ++i) {
-        fwrite(nva[i].name, nva[i].namelen, 1, stdout);
-        printf(": ");
-        fwrite(nva[i].value, nva[i].valuelen, 1, stdout);
-        printf("\n");
-      }
+/*
+ * Escape |n| bytes of |s| as JSON string content (no quotes) into
+ * |out|. Returns the length written, or -1 if it does not fit.
+ */
+static ssize_t
+json_escape(char *out, size_t cap, const char *s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i, o = 0;
+
+    for (i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        size_t need = c == '"' || c == '\\' || c == '\n' || c == '\t' || c == '\r' ? 2
+                    : c < 0x20 ? 6 : 1;
+        if (o + need > cap) {
+            return -1;
+        }
+        if (c == '"' || c == '\\') {
+            out[o++] = '\\';
+            out[o++] = (char)c;
+        } else if (c == '\n') {
+            out[o++] = '\\';
+            out[o++] = 'n';
+        } else if (c == '\t') {
+            out[o++] = '\\';
+            out[o++] = 't';
+        } else if (c == '\r') {
+            out[o++] = '\\';
+            out[o++] = 'r';
+        } else if (c < 0x20) {
+            memcpy(out + o, "\\u00", 4);
+            out[o + 4] = hex[c >> 4];
+            out[o + 5] = hex[c & 15];
+            o += 6;
+        } else {
+            out[o++] = (char)c;
+        }
     }
-    break;
-  case NGHTTP2_RST_STREAM:
-    debug("[INFO] C ----------------------------> S (RST_STREAM)\n");
-    break;
-  case NGHTTP2_GOAWAY:
-    debug("[INFO] C ----------------------------> S (GOAWAY)\n");
-    break;
-  }
-  return 0;
+    return (ssize_t)o;
 }
 
-static int on_frame_recv_callback(nghttp2_session *session,
-                                  const nghttp2_frame *frame,
-                                  void *user_data _U_) {
-  switch (frame->hd.type) {
-  case NGHTTP2_HEADERS:
-    if (frame->headers.cat == NGHTTP2_HCAT_RESPONSE) {
-      struct connection_t *conn = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
-      if (conn) {
-	  debug("[INFO] C <---------------------------- S (HEADERS end)\n");
-      }
-    } else {
-	debug("other header: %d",frame->headers.cat);
+static int
+template_field(struct template_t *tpl, const char *name, size_t len)
+{
+    int i;
+    for (i = 0; i < tpl->nfields; i++) {
+        if (strlen(tpl->names[i]) == len && memcmp(tpl->names[i], name, len) == 0) {
+            return i;
+        }
     }
-    break;
-  case NGHTTP2_RST_STREAM:
-    debug("[INFO] C <---------------------------- S (RST_STREAM)\n");
-    break;
-  case NGHTTP2_GOAWAY:
-    debug("[INFO] C <---------------------------- S (GOAWAY)\n");
-    break;
-  }
-  return 0;
+    if (tpl->nfields == MAX_TEMPLATE_FIELDS || len >= sizeof(tpl->names[0])) {
+        return -1;
+    }
+    memcpy(tpl->names[tpl->nfields], name, len);
+    tpl->names[tpl->nfields][len] = 0;
+    return tpl->nfields++;
+}
+
+/*
+ * Split |text|, which the template keeps, into literal segments and
+ * {{name}} placeholders. A placeholder stands for the escaped field
+ * value, so it belongs inside a JSON string.
+ */
+static bool
+template_parse(struct template_t *tpl, char *text)
+{
+    const char *p = text;
+    const char *open, *close;
+
+    bzero(tpl, sizeof(*tpl));
+    tpl->text = text;
+    tpl->csv_token = -1;
+    while (*p) {
+        if (tpl->nsegs + 2 > MAX_TEMPLATE_SEGS) {
+            fprintf(stderr, "-template has too many placeholders\n");
+            return false;
+        }
+        open = strstr(p, "{{");
+        close = open ? strstr(open + 2, "}}") : NULL;
+        if (close == NULL) {
+            tpl->segs[tpl->nsegs].lit = p;
+            tpl->segs[tpl->nsegs++].len = strlen(p);
+            break;
+        }
+        if (open > p) {
+            tpl->segs[tpl->nsegs].lit = p;
+            tpl->segs[tpl->nsegs++].len = (size_t)(open - p);
+        }
+        tpl->segs[tpl->nsegs].field = template_field(tpl, open + 2, (size_t)(close - open - 2));
+        if (tpl->segs[tpl->nsegs].field < 0) {
+            fprintf(stderr, "-template: bad or too many fields\n");
+            return false;
+        }
+        tpl->nsegs++;
+        p = close + 2;
+    }
+    return true;
+}
+
+/*
+ * Split a CSV line in place: fields are comma separated, a quoted
+ * field may hold commas and "" for a quote. Returns the field count.
+ */
+static int
+csv_split(char *line, const char **v, size_t *len, int max)
+{
+    char *p = line;
+    int n = 0;
+
+    while (n < max) {
+        if (*p == '"') {
+            char *o = ++p;
+            v[n] = o;
+            while (*p && !(*p == '"' && p[1] != '"')) {
+                if (*p == '"') {
+                    p++;
+                }
+                *o++ = *p++;
+            }
+            len[n] = (size_t)(o - v[n]);
+            n++;
+            if (*p == '"') {
+                p++;
+            }
+        } else {
+            v[n] = p;
+            while (*p && *p != ',') {
+                p++;
+            }
+            len[n] = (size_t)(p - v[n]);
+            n++;
+        }
+        if (*p != ',') {
+            break;
+        }
+        p++;
+    }
+    return n;
+}
+
+/* map the columns of a CSV header line to the template's fields */
+static bool
+template_bind_csv(struct template_t *tpl, char *header)
+{
+    const char *v[MAX_TEMPLATE_FIELDS * 4];
+    size_t len[MAX_TEMPLATE_FIELDS * 4];
+    int n = csv_split(header, v, len, MAX_TEMPLATE_FIELDS * 4);
+    int i, f;
+
+    tpl->csv = true;
+    for (f = 0; f < tpl->nfields; f++) {
+        tpl->csv_col[f] = -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (len[i] == 5 && memcmp(v[i], "token", 5) == 0) {
+            tpl->csv_token = i;
+            continue;
+        }
+        for (f = 0; f < tpl->nfields; f++) {
+            if (strlen(tpl->names[f]) == len[i] && memcmp(tpl->names[f], v[i], len[i]) == 0) {
+                tpl->csv_col[f] = i;
+            }
+        }
+    }
+    if (tpl->csv_token < 0) {
+        fprintf(stderr, "-tokens: the CSV header has no \"token\" column\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Pick the token and field values out of one -tokens |line|, in place
+ * and without allocating. Fields the line does not have are empty.
+ */
+static bool
+template_fields(const struct template_t *tpl, char *line, struct fields_t *fields)
+{
+    bzero(fields, sizeof(*fields));
+    if (tpl->csv) {
+        const char *v[MAX_TEMPLATE_FIELDS * 4];
+        size_t len[MAX_TEMPLATE_FIELDS * 4];
+        int n = csv_split(line, v, len, MAX_TEMPLATE_FIELDS * 4);
+        int f;
+
+        if (tpl->csv_token >= n) {
+            return false;
+        }
+        fields->token = v[tpl->csv_token];
+        fields->token_len = len[tpl->csv_token];
+        for (f = 0; f < tpl->nfields; f++) {
+            if (tpl->csv_col[f] >= 0 && tpl->csv_col[f] < n) {
+                fields->v[f] = v[tpl->csv_col[f]];
+                fields->len[f] = len[tpl->csv_col[f]];
+            }
+        }
+    } else {
+        const char *p = json_ws(line, line + strlen(line));
+        const char *e = line + strlen(line);
+        const char *v, *ve;
+        char key[32];
+        int f, rv;
+
+        if (p >= e || *p != '{') {
+            return false;
+        }
+        p++;
+        while ((rv = json_next_member(&p, e, key, sizeof(key), &v, &ve)) == 1) {
+            if (*v == '"') {
+                /* the string's content, still escaped */
+                v++;
+                ve--;
+            }
+            if (string_eq(key, "token")) {
+                fields->token = v;
+                fields->token_len = (size_t)(ve - v);
+                continue;
+            }
+            for (f = 0; f < tpl->nfields; f++) {
+                if (string_eq(key, tpl->names[f])) {
+                    fields->v[f] = v;
+                    fields->len[f] = (size_t)(ve - v);
+                    fields->escaped[f] = true;
+                }
+            }
+        }
+        if (rv < 0) {
+            return false;
+        }
+    }
+    return fields->token != NULL && fields->token_len > 0 && fields->token_len < MAX_TOKEN_LEN;
+}
+
+/* render the payload for |fields| into |out|; -1 if it exceeds |cap| */
+static ssize_t
+template_render(const struct template_t *tpl, const struct fields_t *fields,
+                char *out, size_t cap)
+{
+    size_t o = 0;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < tpl->nsegs; i++) {
+        const struct template_seg_t *seg = &tpl->segs[i];
+        int f = seg->field;
+
+        if (seg->lit) {
+            if (o + seg->len > cap) {
+                return -1;
+            }
+            memcpy(out + o, seg->lit, seg->len);
+            o += seg->len;
+        } else if (fields->escaped[f]) {
+            if (o + fields->len[f] > cap) {
+                return -1;
+            }
+            memcpy(out + o, fields->v[f], fields->len[f]);
+            o += fields->len[f];
+        } else {
+            if ((n = json_escape(out + o, cap - o, fields->v[f], fields->len[f])) < 0) {
+                return -1;
+            }
+            o += (size_t)n;
+        }
+    }
+    return (ssize_t)o;
+}
+
+/*
+ * Device tokens are 64 hex digits, 32 bytes in binary. token_parse()
+ * validates and decodes one in a single pass; the SSE2 and AVX2 kernels
+ * check and convert 16 or 32 digits per instruction, picked at startup
+ * by token_codec_init(), with a scalar version for other CPUs.
+ */
+static int
+hex_value(unsigned char c)
+{
+    if ((unsigned)(c - '0') < 10) {
+        return c - '0';
+    }
+    c |= 0x20;
+    if ((unsigned)(c - 'a') < 6) {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static bool
+token_decode_scalar(const char *s, uint8_t *out)
+{
+    int i, hi, lo;
+
+    for (i = 0; i < TOKEN_BIN_LEN; i++) {
+        hi = hex_value((unsigned char)s[2 * i]);
+        lo = hex_value((unsigned char)s[2 * i + 1]);
+        if ((hi | lo) < 0) {
+            return false;
+        }
+        out[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+}
+
+#ifdef TOKEN_SIMD
+/*
+ * Digits are checked on the byte as is, letters with bit 0x20 set so
+ * that either case passes; bytes of 0x80 and up are negative for the
+ * signed compares and fail both. Each pair of nibbles is then joined
+ * in a 16 bit lane and the lanes packed down to bytes.
+ */
+static bool
+token_decode_sse2(const char *s, uint8_t *out)
+{
+    const __m128i before_0 = _mm_set1_epi8('0' - 1), after_9 = _mm_set1_epi8('9' + 1);
+    const __m128i before_a = _mm_set1_epi8('a' - 1), after_f = _mm_set1_epi8('f' + 1);
+    const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+    __m128i ok = _mm_set1_epi8(-1);
+    __m128i w[4];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 16 * i));
+        __m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, before_0), _mm_cmplt_epi8(c, after_9));
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, before_a), _mm_cmplt_epi8(l, after_f));
+        __m128i nib = _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                                   _mm_andnot_si128(digit, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+        ok = _mm_and_si128(ok, _mm_or_si128(digit, alpha));
+        w[i] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nib, low_bytes), 4),
+                            _mm_srli_epi16(nib, 8));
+    }
+    if (_mm_movemask_epi8(ok) != 0xffff) {
+        return false;
+    }
+    _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(w[0], w[1]));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_packus_epi16(w[2], w[3]));
+    return true;
+}
+
+/* the same on 32 digits at a time; the pack works per 128 bit half */
+__attribute__((target("avx2")))
+static bool
+token_decode_avx2(const char *s, uint8_t *out)
+{
+    const __m256i before_0 = _mm256_set1_epi8('0' - 1), after_9 = _mm256_set1_epi8('9' + 1);
+    const __m256i before_a = _mm256_set1_epi8('a' - 1), after_f = _mm256_set1_epi8('f' + 1);
+    const __m256i low_bytes = _mm256_set1_epi16(0x00ff);
+    __m256i ok = _mm256_set1_epi8(-1);
+    __m256i w[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 32 * i));
+        __m256i l = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+        __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, before_0),
+                                         _mm256_cmpgt_epi8(after_9, c));
+        __m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, before_a),
+                                         _mm256_cmpgt_epi8(after_f, l));
+        __m256i nib = _mm256_blendv_epi8(_mm256_sub_epi8(l, _mm256_set1_epi8('a' - 10)),
+                                         _mm256_sub_epi8(c, _mm256_set1_epi8('0')), digit);
+        ok = _mm256_and_si256(ok, _mm256_or_si256(digit, alpha));
+        w[i] = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(nib, low_bytes), 4),
+                               _mm256_srli_epi16(nib, 8));
+    }
+    if (_mm256_movemask_epi8(ok) != -1) {
+        return false;
+    }
+    _mm256_storeu_si256((__m256i *)out,
+                        _mm256_permute4x64_epi64(_mm256_packus_epi16(w[0], w[1]), 0xd8));
+    return true;
+}
+#endif
+
+static bool (*g_token_decode)(const char *s, uint8_t *out) = token_decode_scalar;
+
+static void
+token_codec_init()
+{
+#ifdef TOKEN_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_token_decode = token_decode_avx2;
+    } else {
+        g_token_decode = token_decode_sse2;
+    }
+#endif
+}
+
+/* |s| is a device token: exactly 64 hex digits, in either case */
+static bool
+token_parse(const char *s, size_t len, struct token_t *t)
+{
+    return len == TOKEN_HEX_LEN && g_token_decode(s, t->b);
+}
+
+/* the normal form of |t|: 64 lowercase hex digits and a NUL */
+static void
+token_format(const struct token_t *t, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < TOKEN_BIN_LEN; i++) {
+        out[2 * i] = hex[t->b[i] >> 4];
+        out[2 * i + 1] = hex[t->b[i] & 15];
+    }
+    out[TOKEN_HEX_LEN] = 0;
+}
+
+/*
+ * Open the -tokens input. A regular file, stdin redirected from one
+ * included, is mapped and split into lines where it lies; a pipe is
+ * read a line at a time.
+ */
+static bool
+input_open(struct input_t *in, const char *path)
+{
+    struct stat sb;
+    int fd;
+
+    bzero(in, sizeof(*in));
+    fd = string_eq(path, "-") ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL);
+            in->map = map;
+            in->size = (size_t)sb.st_size;
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+            return true;
+        }
+    }
+    in->fp = fd == STDIN_FILENO ? stdin : fdopen(fd, "r");
+    if (in->fp == NULL) {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+static void
+input_close(struct input_t *in)
+{
+    if (in->map) {
+        munmap((void *)in->map, in->size);
+        in->map = NULL;
+    } else if (in->fp && in->fp != stdin) {
+        fclose(in->fp);
+    }
+    in->fp = NULL;
+}
+
+/*
+ * The next non-blank line of |in|, without surrounding whitespace. It
+ * is not NUL terminated and, from a mapped file, points into the map.
+ */
+static bool
+input_next(struct input_t *in, const char **line, size_t *len)
+{
+    const char *b, *e, *nl;
+
+    for (;;) {
+        if (in->map) {
+            if (in->pos >= in->size) {
+                return false;
+            }
+            b = in->map + in->pos;
+            nl = memchr(b, '\n', in->size - in->pos);
+            e = nl ? nl : in->map + in->size;
+            in->pos = (size_t)(e - in->map) + (nl ? 1 : 0);
+        } else {
+            if (fgets(in->line, sizeof(in->line), in->fp) == NULL) {
+                return false;
+            }
+            b = in->line;
+            e = in->line + strlen(in->line);
+        }
+        while (b < e && (*b == ' ' || *b == '\t')) b++;
+        while (e > b && (e[-1] == '\n' || e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t')) e--;
+        if (e > b) {
+            *line = b;
+            *len = (size_t)(e - b);
+            return true;
+        }
+    }
+}
+
+static void
+init_global_library()
+{
+    SSL_library_init();
+    SSL_load_error_strings();
+}
+
+static int
+resolve_host(const char *host, uint16_t port, struct endpoint_t *addrs)
+{
+    struct addrinfo hints, *res, *ai;
+    char port_str[6];
+    int n = 0;
+
+    bzero(&hints, sizeof(struct addrinfo));
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    debug("ns looking up %s ...\n", host);
+    if (getaddrinfo(host, port_str, &hints, &res) != 0) {
+        return 0;
+    }
+    for (ai = res; ai && n < MAX_RESOLVED_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(addrs[n].addr)) {
+            continue;
+        }
+        bzero(&addrs[n], sizeof(addrs[n]));
+        memcpy(&addrs[n].addr, ai->ai_addr, ai->ai_addrlen);
+        addrs[n].addrlen = ai->ai_addrlen;
+        n++;
+    }
+    freeaddrinfo(res);
+    return n;
+}
+
+static void*
+resolve_main(void *arg)
+{
+    struct resolve_entry_t *e = arg;
+    struct endpoint_t addrs[MAX_RESOLVED_ADDRS];
+    int n = resolve_host(e->host, e->port, addrs);
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&g_resolver.lock);
+    /* on failure keep serving the old addresses until the next try */
+    if (n > 0) {
+        memcpy(e->addrs, addrs, (size_t)n * sizeof(addrs[0]));
+        e->count = n;
+    }
+    e->expires = monotonic_ms() + (uint64_t)g_resolver.ttl * 1000;
+    e->refreshing = false;
+    while (e->waiters) {
+        struct resolve_wait_t *w = e->waiters;
+        e->waiters = w->next;
+        w->queued = false;
+        w->done = true;
+        if (write(w->fd, &one, sizeof(one)) < 0) {
+            debug("resolver wakeup: %s\n", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&g_resolver.lock);
+    return NULL;
+}
+
+/*
+ * The addresses of |host| in the order to try them (RFC 8305): the
+ * families alternate, IPv6 first, the start rotates from call to call
+ * and addresses that failed recently go last. Returns the count, 0 if
+ * the host does not resolve, or -1 while its first lookup is under
+ * way: |w| is signalled when it ends, then call again with it.
+ */
+static int
+resolve_lookup(const char *host, uint16_t port, struct endpoint_t *out,
+               struct resolve_wait_t *w)
+{
+    struct resolve_entry_t *e;
+    struct endpoint_t v6[MAX_RESOLVED_ADDRS], v4[MAX_RESOLVED_ADDRS];
+    int n6 = 0, n4 = 0, n = 0, i, good;
+    uint64_t now = monotonic_ms();
+
+    pthread_mutex_lock(&g_resolver.lock);
+    for (e = g_resolver.entries; e; e = e->next) {
+        if (e->port == port && string_eq(e->host, host)) {
+            break;
+        }
+    }
+    if (e == NULL) {
+        /* the placeholder others wait on, so the host resolves once */
+        if ((e = calloc(1, sizeof(*e))) == NULL) {
+            pthread_mutex_unlock(&g_resolver.lock);
+            return 0;
+        }
+        snprintf(e->host, sizeof(e->host), "%s", host);
+        e->port = port;
+        e->next = g_resolver.entries;
+        g_resolver.entries = e;
+    }
+    /* the lookup |w| waited for found nothing */
+    if (e->count == 0 && !e->refreshing && w->done) {
+        pthread_mutex_unlock(&g_resolver.lock);
+        return 0;
+    }
+    if ((e->count == 0 || e->expires <= now) && !e->refreshing) {
+        pthread_t t;
+        e->refreshing = true;
+        if (helper_thread_create(&t, resolve_main, e) == 0) {
+            pthread_detach(t);
+        } else {
+            e->refreshing = false;
+        }
+    }
+    if (e->count == 0) {
+        if (!e->refreshing) {
+            pthread_mutex_unlock(&g_resolver.lock);
+            return 0;
+        }
+        if (!w->queued) {
+            w->queued = true;
+            w->done = false;
+            w->next = e->waiters;
+            e->waiters = w;
+        }
+        pthread_mutex_unlock(&g_resolver.lock);
+        return -1;
+    }
+
+    for (i = 0; i < e->count; i++) {
+        const struct endpoint_t *a = &e->addrs[(e->rotate + (unsigned)i) % (unsigned)e->count];
+        if (a->addr.ss_family == AF_INET6) {
+            v6[n6++] = *a;
+        } else {
+            v4[n4++] = *a;
+        }
+    }
+    e->rotate++;
+    pthread_mutex_unlock(&g_resolver.lock);
+
+    for (i = 0; i < n6 || i < n4; i++) {
+        if (i < n6) out[n++] = v6[i];
+        if (i < n4) out[n++] = v4[i];
+    }
+    /* stable partition: penalised addresses to the back */
+    for (i = 0, good = 0; i < n; i++) {
+        if (out[i].failed_until <= now) {
+            struct endpoint_t a = out[i];
+            memmove(&out[good + 1], &out[good], (size_t)(i - good) * sizeof(a));
+            out[good++] = a;
+        }
+    }
+    return n;
+}
+
+/* |w| no longer waits: its connection was dropped or timed out */
+static void
+resolve_cancel(struct resolve_wait_t *w)
+{
+    struct resolve_entry_t *e;
+    struct resolve_wait_t **p;
+
+    pthread_mutex_lock(&g_resolver.lock);
+    for (e = g_resolver.entries; e && w->queued; e = e->next) {
+        for (p = &e->waiters; *p; p = &(*p)->next) {
+            if (*p == w) {
+                *p = w->next;
+                w->queued = false;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_resolver.lock);
+}
+
+static void
+resolve_mark_failed(const char *host, uint16_t port, const struct endpoint_t *a)
+{
+    struct resolve_entry_t *e;
+    int i;
+
+    pthread_mutex_lock(&g_resolver.lock);
+    for (e = g_resolver.entries; e; e = e->next) {
+        if (e->port != port || !string_eq(e->host, host)) {
+            continue;
+        }
+        for (i = 0; i < e->count; i++) {
+            if (e->addrs[i].addrlen == a->addrlen &&
+                memcmp(&e->addrs[i].addr, &a->addr, a->addrlen) == 0) {
+                e->addrs[i].failed_until = monotonic_ms() + ENDPOINT_PENALTY_MS;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_resolver.lock);
+}
+
+static const char*
+endpoint_str(const struct endpoint_t *a, char *buf, size_t size)
+{
+    char host[INET6_ADDRSTRLEN], serv[8];
+
+    if (getnameinfo((const struct sockaddr *)&a->addr, a->addrlen, host, sizeof(host),
+                    serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        snprintf(buf, size, "?");
+    } else if (a->addr.ss_family == AF_INET6) {
+        snprintf(buf, size, "[%s]:%s", host, serv);
+    } else {
+        snprintf(buf, size, "%s:%s", host, serv);
+    }
+    return buf;
+}
+
+static X509*
+read_x509_certificate(const char* path)
+{
+    BIO  *bio = NULL;
+    X509 *x509 = NULL;
+    if (NULL == (bio = BIO_new_file(path, "r"))) {
+        return NULL;
+    }
+    x509 = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    return x509;
+}
+
+/*
+ * Callback function for TLS NPN. Since this program only supports
+ * HTTP/2 protocol, if server does not offer HTTP/2 the nghttp2
+ * library supports, we terminate program.
+ */
+static int
+select_next_proto_cb(SSL *ssl, unsigned char **out,
+                     unsigned char *outlen, const unsigned char *in,
+                     unsigned int inlen, void *arg)
+{
+    int rv;
+  /* nghttp2_select_next_protocol() selects HTTP/2 protocol the
+     nghttp2 library supports. */
+    rv = nghttp2_select_next_protocol(out, outlen, in, inlen);
+    if (rv <= 0) {
+        die("Server did not advertise HTTP/2 protocol");
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/* base64url without padding, as JWT wants it */
+static bool
+buf_base64url(struct buf_t *b, const unsigned char *data, size_t n)
+{
+    size_t i, len = 4 * ((n + 2) / 3);
+
+    if (!buf_reserve(b, len + 1)) {
+        return false;
+    }
+    EVP_EncodeBlock((unsigned char *)b->data + b->len, data, (int)n);
+    while (len > 0 && b->data[b->len + len - 1] == '=') {
+        len--;
+    }
+    for (i = 0; i < len; i++) {
+        char *c = &b->data[b->len + i];
+        *c = *c == '+' ? '-' : *c == '/' ? '_' : *c;
+    }
+    b->len += len;
+    return true;
+}
+
+/*
+ * Sign a fresh ES256 provider token. ECDSA gives a DER signature,
+ * JWS wants r and s as two 32 byte big endian numbers.
+ */
+static struct jwt_token_t*
+jwt_sign(struct jwt_t *jwt, time_t now)
+{
+    struct buf_t b = { NULL, 0, 0 };
+    struct jwt_token_t *t = NULL;
+    char part[256];
+    unsigned char der[128], rs[64];
+    const unsigned char *q = der;
+    size_t derlen = sizeof(der);
+    size_t input;
+    EVP_MD_CTX *md = NULL;
+    ECDSA_SIG *sig = NULL;
+    const BIGNUM *r, *s;
+    bool ok;
+
+    ok = buf_puts(&b, "bearer ");
+    input = b.len;
+    snprintf(part, sizeof(part), "{\"alg\":\"ES256\",\"kid\":\"%s\"}", jwt->key_id);
+    ok = ok && buf_base64url(&b, (unsigned char *)part, strlen(part)) && buf_puts(&b, ".");
+    snprintf(part, sizeof(part), "{\"iss\":\"%s\",\"iat\":%lld}", jwt->team_id, (long long)now);
+    ok = ok && buf_base64url(&b, (unsigned char *)part, strlen(part));
+
+    ok = ok && (md = EVP_MD_CTX_new()) != NULL &&
+         EVP_DigestSignInit(md, NULL, EVP_sha256(), NULL, jwt->key) == 1 &&
+         EVP_DigestSign(md, der, &derlen, (unsigned char *)b.data + input, b.len - input) == 1 &&
+         (sig = d2i_ECDSA_SIG(NULL, &q, (long)derlen)) != NULL;
+    if (ok) {
+        ECDSA_SIG_get0(sig, &r, &s);
+        ok = BN_bn2binpad(r, rs, 32) == 32 && BN_bn2binpad(s, rs + 32, 32) == 32 &&
+             buf_puts(&b, ".") && buf_base64url(&b, rs, sizeof(rs)) && buf_append(&b, "", 1);
+    }
+    ECDSA_SIG_free(sig);
+    EVP_MD_CTX_free(md);
+
+    if (ok && (t = calloc(1, sizeof(*t))) != NULL) {
+        t->value = b.data;
+        t->len = b.len - 1;
+        t->iat = now;
+        return t;
+    }
+    buf_free(&b);
+    return NULL;
+}
+
+/* re-sign once the token gets close to APNs' one hour limit */
+static bool
+jwt_refresh(struct jwt_t *jwt)
+{
+    struct jwt_token_t *cur, *t;
+    time_t now = time(NULL);
+    bool ok = true;
+
+    pthread_mutex_lock(&jwt->lock);
+    cur = atomic_load(&jwt->current);
+    if (cur == NULL || now - cur->iat >= JWT_REFRESH_SECS) {
+        t = jwt_sign(jwt, now);
+        if (t) {
+            t->prev = cur;
+            atomic_store_explicit(&jwt->current, t, memory_order_release);
+            debug("[INFO] provider token signed, iat %lld\n", (long long)now);
+        } else {
+            fprintf(stderr, "sign provider token fail.\n");
+            ok = false;
+        }
+    }
+    pthread_mutex_unlock(&jwt->lock);
+    return ok;
+}
+
+static bool
+jwt_init(struct jwt_t *jwt, const struct opt_t *opt)
+{
+    FILE *fp = fopen(opt->p8, "r");
+
+    if (fp == NULL) {
+        return false;
+    }
+    jwt->key = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if (jwt->key == NULL || EVP_PKEY_base_id(jwt->key) != EVP_PKEY_EC) {
+        fprintf(stderr, "%s is not an EC private key\n", opt->p8);
+        return false;
+    }
+    jwt->key_id = opt->key_id;
+    jwt->team_id = opt->team_id;
+    return jwt_refresh(jwt);
+}
+
+static void
+jwt_destroy(struct jwt_t *jwt)
+{
+    struct jwt_token_t *t = atomic_load(&jwt->current);
+
+    while (t) {
+        struct jwt_token_t *prev = t->prev;
+        free(t->value);
+        free(t);
+        t = prev;
+    }
+    atomic_store(&jwt->current, NULL);
+    EVP_PKEY_free(jwt->key);
+    jwt->key = NULL;
+}
+
+static bool
+session_expired(SSL_SESSION *sess, time_t now)
+{
+    return !SSL_SESSION_is_resumable(sess) ||
+           (time_t)(SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess)) <= now;
+}
+
+/* call with the cache locked */
+static struct session_entry_t*
+session_cache_entry(const char *key, bool create)
+{
+    struct session_entry_t *e;
+
+    for (e = g_session_cache.entries; e; e = e->next) {
+        if (string_eq(e->key, key)) {
+            return e;
+        }
+    }
+    if (!create || (e = calloc(1, sizeof(*e))) == NULL) {
+        return NULL;
+    }
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    e->next = g_session_cache.entries;
+    g_session_cache.entries = e;
+    return e;
+}
+
+/* takes over the caller's reference to |sess|; the oldest one goes when full */
+static void
+session_cache_put(const char *key, SSL_SESSION *sess)
+{
+    struct session_entry_t *e;
+
+    pthread_mutex_lock(&g_session_cache.lock);
+    e = session_cache_entry(key, true);
+    if (e == NULL) {
+        SSL_SESSION_free(sess);
+    } else {
+        if (e->count == SESSION_CACHE_SLOTS) {
+            SSL_SESSION_free(e->sessions[0]);
+            memmove(e->sessions, e->sessions + 1, (size_t)(--e->count) * sizeof(SSL_SESSION *));
+        }
+        e->sessions[e->count++] = sess;
+    }
+    pthread_mutex_unlock(&g_session_cache.lock);
+}
+
+/* the newest usable session for |key|, or NULL; the caller owns it */
+static SSL_SESSION*
+session_cache_take(const char *key)
+{
+    struct session_entry_t *e;
+    SSL_SESSION *sess = NULL;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&g_session_cache.lock);
+    e = session_cache_entry(key, false);
+    while (e && e->count > 0 && sess == NULL) {
+        sess = e->sessions[--e->count];
+        if (session_expired(sess, now)) {
+            SSL_SESSION_free(sess);
+            sess = NULL;
+        }
+    }
+    pthread_mutex_unlock(&g_session_cache.lock);
+    return sess;
+}
+
+/* TLS 1.3 tickets arrive after the handshake, from inside SSL_read() */
+static int
+new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+    struct connection_t *conn = SSL_get_app_data(ssl);
+
+    if (conn == NULL || SSL_version(ssl) < TLS1_3_VERSION) {
+        return 0;
+    }
+    session_cache_put(conn->tls_key, sess);
+    return 1;
+}
+
+/*
+ * -session-file: one "<key> <base64 DER session>" line per session.
+ * Expired sessions are dropped on the way in and out.
+ */
+static void
+session_cache_load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    time_t now = time(NULL);
+    int loaded = 0;
+
+    if (fp == NULL) {
+        return;
+    }
+    while ((n = getline(&line, &cap, fp)) > 0) {
+        char *sp = strchr(line, ' ');
+        unsigned char *der;
+        const unsigned char *q;
+        SSL_SESSION *sess;
+        int len;
+
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = 0;
+        }
+        if (sp == NULL || sp - line >= SESSION_KEY_LEN) {
+            continue;
+        }
+        *sp++ = 0;
+        der = malloc(strlen(sp));
+        if (der == NULL) {
+            break;
+        }
+        len = EVP_DecodeBlock(der, (const unsigned char *)sp, (int)strlen(sp));
+        q = der;
+        sess = len > 0 ? d2i_SSL_SESSION(NULL, &q, len) : NULL;
+        free(der);
+        if (sess == NULL) {
+            continue;
+        }
+        if (session_expired(sess, now)) {
+            SSL_SESSION_free(sess);
+            continue;
+        }
+        session_cache_put(line, sess);
+        loaded++;
+    }
+    free(line);
+    fclose(fp);
+    debug("tls sessions: %d loaded from %s\n", loaded, path);
+}
+
+static void
+session_cache_save(const char *path)
+{
+    struct session_entry_t *e;
+    char tmp[PATH_MAX];
+    time_t now = time(NULL);
+    FILE *fp;
+    int fd, i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    /* the file holds session secrets */
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        fprintf(stderr, "save tls sessions to %s fail: %s\n", tmp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    pthread_mutex_lock(&g_session_cache.lock);
+    for (e = g_session_cache.entries; e; e = e->next) {
+        for (i = 0; i < e->count; i++) {
+            unsigned char *der = NULL;
+            unsigned char *b64;
+            int len;
+
+            if (session_expired(e->sessions[i], now) ||
+                (len = i2d_SSL_SESSION(e->sessions[i], &der)) <= 0) {
+                continue;
+            }
+            b64 = malloc((size_t)(4 * ((len + 2) / 3) + 1));
+            if (b64) {
+                EVP_EncodeBlock(b64, der, len);
+                fprintf(fp, "%s %s\n", e->key, b64);
+                free(b64);
+            }
+            OPENSSL_free(der);
+        }
+    }
+    pthread_mutex_unlock(&g_session_cache.lock);
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "save tls sessions to %s fail: %s\n", path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+static uint64_t
+realtime_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* tokens are random, but made up ones (-bench) share long prefixes */
+static uint64_t
+token_hash(const struct token_t *t)
+{
+    uint64_t w[4], h;
+
+    memcpy(w, t->b, sizeof(w));
+    h = w[0] ^ (w[1] * 0x9e3779b97f4a7c15ULL) ^ w[2] ^ (w[3] * 0xc2b2ae3d27d4eb4fULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* map an open store file of |slots| entries */
+static struct dead_table_t*
+dead_table_map(int fd, uint64_t slots)
+{
+    struct dead_table_t *t = calloc(1, sizeof(*t));
+    void *map;
+
+    if (t == NULL) {
+        return NULL;
+    }
+    t->size = sizeof(struct dead_header_t) + slots * sizeof(struct dead_entry_t);
+    map = mmap(NULL, t->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        free(t);
+        return NULL;
+    }
+    t->fd = fd;
+    t->hdr = map;
+    t->entries = (struct dead_entry_t *)(t->hdr + 1);
+    t->mask = slots - 1;
+    return t;
+}
+
+/* size the empty file |fd| for |slots| entries and map it as a new store */
+static struct dead_table_t*
+dead_table_init(int fd, uint64_t slots)
+{
+    struct dead_table_t *t;
+
+    if (ftruncate(fd, (off_t)(sizeof(struct dead_header_t) +
+                              slots * sizeof(struct dead_entry_t))) != 0 ||
+        (t = dead_table_map(fd, slots)) == NULL) {
+        return NULL;
+    }
+    memcpy(t->hdr->magic, DEAD_MAGIC, sizeof(t->hdr->magic));
+    t->hdr->version = DEAD_VERSION;
+    t->hdr->entry_size = sizeof(struct dead_entry_t);
+    t->hdr->slots = slots;
+    return t;
+}
+
+/* a new, empty store of |slots| entries at |path| */
+static struct dead_table_t*
+dead_table_create(const char *path, uint64_t slots)
+{
+    struct dead_table_t *t;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if ((t = dead_table_init(fd, slots)) == NULL) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    return t;
+}
+
+/* the slot of |token| in |t|, or the free slot where it would go, NULL
+   if |t| is full; only for the writer, readers use dead_table_has() */
+static struct dead_entry_t*
+dead_table_find(const struct dead_table_t *t, const struct token_t *token)
+{
+    uint64_t i = token_hash(token) & t->mask;
+    uint64_t n;
+
+    for (n = 0; n <= t->mask; n++) {
+        struct dead_entry_t *e = &t->entries[i];
+        if (atomic_load_explicit(&e->since_ms, memory_order_relaxed) == 0 ||
+            memcmp(&e->token, token, sizeof(*token)) == 0) {
+            return e;
+        }
+        i = (i + 1) & t->mask;
+    }
+    return NULL;
+}
+
+/*
+ * Lock free lookup. A slot's token is only read once its time, loaded
+ * once, says it was written; a slot never changes tokens after that,
+ * so an add racing with us cannot make another token look like ours.
+ */
+static bool
+dead_table_has(const struct dead_table_t *t, const struct token_t *token)
+{
+    uint64_t i = token_hash(token) & t->mask;
+    uint64_t n;
+
+    for (n = 0; n <= t->mask; n++) {
+        const struct dead_entry_t *e = &t->entries[i];
+        if (atomic_load_explicit(&e->since_ms, memory_order_acquire) == 0) {
+            return false;
+        }
+        if (memcmp(&e->token, token, sizeof(*token)) == 0) {
+            return true;
+        }
+        i = (i + 1) & t->mask;
+    }
+    return false;
+}
+
+/* only called with the lock held, or before anything else runs */
+static void
+dead_table_put(struct dead_table_t *t, const struct token_t *token, uint64_t since_ms)
+{
+    struct dead_entry_t *e = dead_table_find(t, token);
+
+    if (e == NULL) {
+        return;
+    }
+    if (atomic_load_explicit(&e->since_ms, memory_order_relaxed) == 0) {
+        e->token = *token;
+        t->hdr->count++;
+    }
+    /* the token first: readers only look at entries with a time */
+    atomic_store_explicit(&e->since_ms, since_ms, memory_order_release);
+}
+
+/*
+ * Open the -dead-tokens store at |path|, creating it if need be. The
+ * file is only mapped, so opening costs the same whatever it holds. It
+ * is locked against a second process writing to it.
+ */
+static bool
+dead_store_open(const char *path)
+{
+    struct dead_header_t hdr;
+    struct stat sb;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "-dead-tokens: open %s fail: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "-dead-tokens: %s is in use\n", path);
+        close(fd);
+        return false;
+    }
+    g_dead.path = path;
+    if (fstat(fd, &sb) == 0 && sb.st_size == 0) {
+        /* still holding the lock, so no one else initialises it too */
+        if ((g_dead.table = dead_table_init(fd, DEAD_MIN_SLOTS)) == NULL) {
+            fprintf(stderr, "-dead-tokens: create %s fail: %s\n", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        return true;
+    }
+    if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, DEAD_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != DEAD_VERSION || hdr.entry_size != sizeof(struct dead_entry_t) ||
+        hdr.slots < DEAD_MIN_SLOTS || (hdr.slots & (hdr.slots - 1)) != 0 ||
+        (uint64_t)sb.st_size != sizeof(hdr) + hdr.slots * sizeof(struct dead_entry_t)) {
+        fprintf(stderr, "-dead-tokens: %s is not a token store\n", path);
+        close(fd);
+        return false;
+    }
+    if ((g_dead.table = dead_table_map(fd, hdr.slots)) == NULL) {
+        close(fd);
+        return false;
+    }
+    debug("dead tokens: %llu loaded from %s\n", (unsigned long long)hdr.count, path);
+    return true;
+}
+
+/* the token was reported invalid before: no need to push to it */
+static bool
+dead_store_has(const struct token_t *token)
+{
+    struct dead_table_t *t = atomic_load_explicit(&g_dead.table, memory_order_acquire);
+
+    return t != NULL && dead_table_has(t, token);
+}
+
+/*
+ * Past half full, the store is rebuilt at twice the size in a new file
+ * that then replaces the old one. Threads may still be looking at the
+ * old table, so it stays mapped (on the |prev| chain) until exit.
+ */
+static void
+dead_store_grow()
+{
+    struct dead_table_t *old = g_dead.table, *t;
+    char tmp[PATH_MAX];
+    uint64_t i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_dead.path);
+    t = dead_table_create(tmp, 2 * (old->mask + 1));
+    if (t == NULL) {
+        fprintf(stderr, "-dead-tokens: grow %s fail: %s\n", g_dead.path, strerror(errno));
+        return;
+    }
+    for (i = 0; i <= old->mask; i++) {
+        uint64_t since_ms = atomic_load(&old->entries[i].since_ms);
+        if (since_ms) {
+            dead_table_put(t, &old->entries[i].token, since_ms);
+        }
+    }
+    if (flock(t->fd, LOCK_EX | LOCK_NB) != 0 || rename(tmp, g_dead.path) != 0) {
+        fprintf(stderr, "-dead-tokens: replace %s fail: %s\n", g_dead.path, strerror(errno));
+        munmap(t->hdr, t->size);
+        close(t->fd);
+        free(t);
+        unlink(tmp);
+        return;
+    }
+    t->prev = old;
+    atomic_store_explicit(&g_dead.table, t, memory_order_release);
+}
+
+/* record that APNs called |token| invalid at |since_ms| */
+static void
+dead_store_add(const struct token_t *token, uint64_t since_ms)
+{
+    struct dead_table_t *t;
+
+    pthread_mutex_lock(&g_dead.lock);
+    t = g_dead.table;
+    if (!g_dead.full && t->hdr->count >= DEAD_MAX_LOAD(t->mask + 1)) {
+        /* growing failed (disk full, ...) until now: one last try */
+        dead_store_grow();
+        t = g_dead.table;
+        if (t->hdr->count >= DEAD_MAX_LOAD(t->mask + 1)) {
+            fprintf(stderr, "-dead-tokens: %s is full, no more tokens are added\n", g_dead.path);
+            g_dead.full = true;
+        }
+    }
+    if (g_dead.full) {
+        pthread_mutex_unlock(&g_dead.lock);
+        return;
+    }
+    dead_table_put(t, token, since_ms ? since_ms : 1);
+    if (t->hdr->count * 2 > t->mask + 1) {
+        dead_store_grow();
+    }
+    pthread_mutex_unlock(&g_dead.lock);
+}
+
+static void
+dead_store_close()
+{
+    struct dead_table_t *t = g_dead.table, *prev;
+
+    for (; t; t = prev) {
+        prev = t->prev;
+        munmap(t->hdr, t->size);
+        close(t->fd);
+        free(t);
+    }
+    g_dead.table = NULL;
+}
+
+/*
+ * Room for |expect| tokens below 3/4 load, in a power of two of 32 byte
+ * slots; it doubles if the guess was short (a pipe has no size).
+ */
+static void
+token_set_init(struct token_set_t *set, uint64_t expect)
+{
+    uint64_t slots = 1024;
+
+    while (slots * 3 / 4 < expect) {
+        slots *= 2;
+    }
+    bzero(set, sizeof(*set));
+    set->slots = calloc(slots, sizeof(struct token_t));
+    if (set->slots == NULL) {
+        die("alloc -dedup set fail.");
+    }
+    set->mask = slots - 1;
+}
+
+static bool
+token_zero(const struct token_t *t)
+{
+    uint64_t w[4];
+
+    memcpy(w, t->b, sizeof(w));
+    return (w[0] | w[1] | w[2] | w[3]) == 0;
+}
+
+/* the slot of |t| in |slots|, or the free one where it would go */
+static struct token_t*
+token_set_slot(struct token_t *slots, uint64_t mask, const struct token_t *t)
+{
+    uint64_t i = token_hash(t) & mask;
+
+    while (!token_zero(&slots[i]) && memcmp(&slots[i], t, sizeof(*t)) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static void
+token_set_grow(struct token_set_t *set)
+{
+    uint64_t slots = 2 * (set->mask + 1), i;
+    struct token_t *grown = calloc(slots, sizeof(struct token_t));
+
+    if (grown == NULL) {
+        die("alloc -dedup set fail.");
+    }
+    for (i = 0; i <= set->mask; i++) {
+        if (!token_zero(&set->slots[i])) {
+            *token_set_slot(grown, slots - 1, &set->slots[i]) = set->slots[i];
+        }
+    }
+    free(set->slots);
+    set->slots = grown;
+    set->mask = slots - 1;
+}
+
+/* add |t| to |set|; false if it was there already */
+static bool
+token_set_add(struct token_set_t *set, const struct token_t *t)
+{
+    struct token_t *slot;
+
+    if (token_zero(t)) {
+        if (set->zero) {
+            return false;
+        }
+        set->zero = true;
+        return true;
+    }
+    slot = token_set_slot(set->slots, set->mask, t);
+    if (!token_zero(slot)) {
+        return false;
+    }
+    *slot = *t;
+    if (++set->count > (set->mask + 1) * 3 / 4) {
+        token_set_grow(set);
+    }
+    return true;
+}
+
+static void
+token_set_free(struct token_set_t *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+}
+
+static void
+init_ssl_ctx(SSL_CTX *ssl_ctx)
+{
+  /* Disable SSLv2 and enable all workarounds for buggy servers */
+    SSL_CTX_set_options(ssl_ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2);
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_AUTO_RETRY);
+    SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
+  /* Set NPN callback */
+    SSL_CTX_set_next_proto_select_cb(ssl_ctx, select_next_proto_cb, NULL);
+  /* sessions live in g_session_cache, not in the context */
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, new_session_cb);
+}
+
+/*
+ * Read |cert| (NULL: no client certificate) and its key into |t|: a
+ * ready SSL_CTX, the session cache key, the topic and expiry date.
+ */
+static bool
+tenant_load(struct tenant_t *t, const char *cert, const char *pkey)
+{
+    const struct opt_t *opt = g_tenants.opt;
+    X509 *x509 = NULL;
+    X509_NAME *xn;
+    SSL_CTX *ctx;
+    struct tm tm;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen = 0, i;
+    int n, pos;
+
+    if (cert && NULL == (x509 = read_x509_certificate(cert))) {
+        fprintf(stderr, "read certificate %s fail\n", cert);
+        return false;
+    }
+    ctx = SSL_CTX_new(SSLv23_client_method());
+    if (ctx == NULL) {
+        X509_free(x509);
+        return false;
+    }
+    init_ssl_ctx(ctx);
+    if (x509 && (SSL_CTX_use_certificate(ctx, x509) != 1 ||
+                 SSL_CTX_use_PrivateKey_file(ctx, pkey ? pkey : cert, SSL_FILETYPE_PEM) != 1 ||
+                 SSL_CTX_check_private_key(ctx) != 1)) {
+        fprintf(stderr, "private key for %s fail: %s\n", cert,
+                ERR_error_string(ERR_get_error(), NULL));
+        SSL_CTX_free(ctx);
+        X509_free(x509);
+        return false;
+    }
+
+    bzero(t->tls_key, sizeof(t->tls_key));
+    n = snprintf(t->tls_key, sizeof(t->tls_key), "%s:%u:", opt->uri, opt->port);
+    if (x509) {
+        X509_digest(x509, EVP_sha256(), md, &mdlen);
+    } else {
+        snprintf(t->tls_key + n, sizeof(t->tls_key) - (size_t)n, "-");
+    }
+    for (i = 0; i < mdlen && n + 2 < (int)sizeof(t->tls_key); i++) {
+        n += snprintf(t->tls_key + n, sizeof(t->tls_key) - (size_t)n, "%02x", md[i]);
+    }
+
+    t->topic = NULL;
+    t->not_after = 0;
+    if (x509) {
+        xn = X509_get_subject_name(x509);
+        pos = X509_NAME_get_index_by_NID(xn, NID_userId, -1);
+        if (pos >= 0) {
+            ASN1_STRING *d = X509_NAME_ENTRY_get_data(X509_NAME_get_entry(xn, pos));
+            t->topic = alloc_string((const char *)ASN1_STRING_get0_data(d));
+        }
+        if (ASN1_TIME_to_tm(X509_get0_notAfter(x509), &tm) == 1) {
+            t->not_after = timegm(&tm);
+        }
+        X509_free(x509);
+    }
+    t->cert = cert;
+    t->pkey = pkey;
+    t->ctx = ctx;
+    return true;
+}
+
+/* APNs refuses an expired certificate; say so before it does */
+static void
+tenant_report(const struct tenant_t *t)
+{
+    time_t now = time(NULL);
+    char date[32] = "?";
+    struct tm tm;
+
+    if (t->cert == NULL) {
+        return;
+    }
+    if (t->not_after && gmtime_r(&t->not_after, &tm)) {
+        strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+    }
+    if (t->not_after && t->not_after < now) {
+        fprintf(stderr, "certificate %s (%s) expired on %s\n", t->cert,
+                t->topic ? t->topic : "no topic", date);
+    } else if (t->not_after && t->not_after - now < CERT_EXPIRY_WARN_DAYS * 86400) {
+        fprintf(stderr, "certificate %s (%s) expires on %s\n", t->cert,
+                t->topic ? t->topic : "no topic", date);
+    } else {
+        debug("certificate %s: topic %s, expires %s\n", t->cert,
+              t->topic ? t->topic : "-", date);
+    }
+}
+
+/*
+ * The tenant whose certificate covers |topic|: its UID, or the UID
+ * with a suffix such as ".voip" or ".complication". A single tenant
+ * takes every topic, as one -cert always did.
+ */
+static struct tenant_t*
+tenant_for_topic(const char *topic)
+{
+    struct tenant_t *best = NULL;
+    size_t len, best_len = 0;
+    int i;
+
+    if (g_tenants.count == 1) {
+        return &g_tenants.list[0];
+    }
+    for (i = 0; i < g_tenants.count; i++) {
+        struct tenant_t *t = &g_tenants.list[i];
+        if (t->topic == NULL) {
+            continue;
+        }
+        len = strlen(t->topic);
+        if (strncmp(topic, t->topic, len) == 0 && (topic[len] == 0 || topic[len] == '.') &&
+            (best == NULL || len > best_len)) {
+            best = t;
+            best_len = len;
+        }
+    }
+    return best;
+}
+
+/* load every -cert once, or with -p8 the one context without any */
+static void
+tenants_init(const struct opt_t *opt)
+{
+    int i, j;
+
+    g_tenants.opt = opt;
+    for (i = 0; i < (opt->ncerts ? opt->ncerts : 1); i++) {
+        struct tenant_t *t = &g_tenants.list[i];
+        t->index = i;
+        if (!tenant_load(t, opt->ncerts ? opt->certs[i] : NULL, opt->pkeys[i])) {
+            die("load certificate fail.");
+        }
+        tenant_report(t);
+        for (j = 0; j < i; j++) {
+            if (t->topic && g_tenants.list[j].topic &&
+                string_eq(t->topic, g_tenants.list[j].topic)) {
+                fprintf(stderr, "%s and %s are both for %s, the first one is used\n",
+                        g_tenants.list[j].cert, t->cert, t->topic);
+            }
+        }
+        g_tenants.count++;
+    }
+}
+
+/*
+ * SIGHUP: read every certificate again. A changed one replaces the
+ * tenant's context for new connections; a file that no longer loads
+ * leaves the old one in place. Its topic and expiry are taken over only
+ * when the key fingerprint changed.
+ *
+ * Only -daemon reloads, and it forces -threads 0, so this runs on the
+ * one loop thread: tenant_for_topic() reads t->topic there without the
+ * lock, and the old string is freed with no reader left.
+ */
+static void
+tenants_reload()
+{
+    struct tenant_t fresh;
+    char *old_topic;
+    int i;
+
+    assert(g_tenants.opt->threads == 0);
+    for (i = 0; i < g_tenants.count; i++) {
+        struct tenant_t *t = &g_tenants.list[i];
+        if (t->cert == NULL) {
+            continue;
+        }
+        if (!tenant_load(&fresh, t->cert, t->pkey)) {
+            fprintf(stderr, "reload %s fail, still using the one loaded before\n", t->cert);
+            continue;
+        }
+        if (string_eq(fresh.tls_key, t->tls_key)) {
+            debug("certificate %s unchanged\n", t->cert);
+            SSL_CTX_free(fresh.ctx);
+            free(fresh.topic);
+            continue;
+        }
+        pthread_mutex_lock(&g_tenants.lock);
+        /* connections hold their own references to the old context */
+        SSL_CTX_free(t->ctx);
+        t->ctx = fresh.ctx;
+        memcpy(t->tls_key, fresh.tls_key, sizeof(t->tls_key));
+        old_topic = t->topic;
+        t->topic = fresh.topic;
+        t->not_after = fresh.not_after;
+        t->generation++;
+        pthread_mutex_unlock(&g_tenants.lock);
+        free(old_topic);
+        fprintf(stderr, "certificate %s reloaded (%s)\n", t->cert, t->topic ? t->topic : "no topic");
+        tenant_report(t);
+    }
+}
+
+static void
+tenants_free()
+{
+    int i;
+
+    for (i = 0; i < g_tenants.count; i++) {
+        SSL_CTX_free(g_tenants.list[i].ctx);
+        free(g_tenants.list[i].topic);
+    }
+    g_tenants.count = 0;
+}
+
+/*
+ * Counts the application data records |conn| sends: OpenSSL reports
+ * every record header it writes, which is what -bench and the summary
+ * show coalescing against, rather than an estimate from SSL_write()
+ * sizes. Records of the handshake itself are left out.
+ */
+static void
+ssl_record_cb(int write_p, int version, int content_type, const void *buf,
+              size_t len, SSL *ssl, void *arg)
+{
+    struct connection_t *conn = arg;
+
+    if (write_p && content_type == SSL3_RT_HEADER && len >= 1 &&
+        ((const uint8_t *)buf)[0] == SSL3_RT_APPLICATION_DATA &&
+        SSL_is_init_finished(ssl)) {
+        conn->pool->stats.records++;
+    }
+}
+
+/* a TLS object for |conn| from its tenant's shared context */
+static bool
+ssl_allocate(struct connection_t *conn)
+{
+    struct tenant_t *t = conn->tenant;
+    SSL *ssl;
+    SSL_SESSION *sess;
+
+    pthread_mutex_lock(&g_tenants.lock);
+    ssl = SSL_new(t->ctx);
+    memcpy(conn->tls_key, t->tls_key, sizeof(conn->tls_key));
+    conn->generation = t->generation;
+    pthread_mutex_unlock(&g_tenants.lock);
+    if (ssl == NULL) {
+        return false;
+    }
+    SSL_set_app_data(ssl, conn);
+    SSL_set_msg_callback(ssl, ssl_record_cb);
+    SSL_set_msg_callback_arg(ssl, conn);
+    if ((sess = session_cache_take(conn->tls_key)) != NULL) {
+        SSL_set_session(ssl, sess);
+        SSL_SESSION_free(sess);
+    }
+    conn->ssl = ssl;
+    return true;
+}
+
+/*
+ * One step of the TLS handshake of |conn| on its non-blocking socket:
+ * 1 when done, 0 when it has to wait (conn->want_io tells for what),
+ * -1 on failure.
+ */
+static int
+ssl_handshake(struct connection_t *conn)
+{
+    SSL *ssl = conn->ssl;
+    int rv;
+
+    ERR_clear_error();
+    rv = SSL_do_handshake(ssl);
+
+    if(rv==1) {
+            debug("Connected with encryption: %s\n", SSL_get_cipher(ssl));
+    }
+    if (rv <= 0) {
+	unsigned long ssl_err = SSL_get_error(ssl,rv);
+	if (ssl_err == SSL_ERROR_WANT_READ || ssl_err == SSL_ERROR_WANT_WRITE) {
+	    conn->want_io = ssl_err == SSL_ERROR_WANT_READ ? WANT_READ : WANT_WRITE;
+	    return 0;
+	}
+	debug("rv = %d\n",rv);
+	int geterror = ERR_peek_error();
+	int reason = ERR_GET_REASON(geterror);
+	debug("rv %d, ssl_error %lu, get_err %d, reason %d \n",rv, ssl_err, geterror ,reason);
+	debug("errmsg: %s\n", ERR_error_string(ERR_get_error(), NULL));
+	debug("errmsg msg: %s\n", ERR_reason_error_string(ERR_peek_error()));
+	debug("Error: %s\n", ERR_reason_error_string(ERR_get_error()));
+	    switch(reason)
+	    {
+	        case SSL_R_SSLV3_ALERT_CERTIFICATE_EXPIRED: /*,define in <openssl/ssl.h> "sslv3 alert certificate expired"},*/
+	          reason = X509_V_ERR_CERT_HAS_EXPIRED;
+	            printf("X509_V_ERR_CERT_HAS_EXPIRED\n");
+	            break;
+	        case SSL_R_SSLV3_ALERT_CERTIFICATE_REVOKED: /*,"sslv3 alert certificate revoked"},*/
+	          reason = X509_V_ERR_CERT_REVOKED;
+	            printf("X509_V_ERR_CERT_REVOKED\n");
+	            break;
+	    }
+
+        fprintf(stderr, "%s\n", ERR_error_string(ERR_get_error(), NULL));
+        return -1;
+    }
+    return 1;
+}
+
+/* the handshake of |conn| completed: account for its session */
+static void
+ssl_handshake_done(struct connection_t *conn)
+{
+    debug("ssl handshake ok\n");
+    pthread_mutex_lock(&g_session_cache.lock);
+    if (SSL_session_reused(conn->ssl)) {
+        g_session_cache.resumed++;
+    } else {
+        g_session_cache.full++;
+    }
+    pthread_mutex_unlock(&g_session_cache.lock);
+    debug("tls session %s\n", SSL_session_reused(conn->ssl) ? "resumed" : "full handshake");
+    if (SSL_version(conn->ssl) < TLS1_3_VERSION) {
+        SSL_SESSION *sess = SSL_get1_session(conn->ssl);
+        if (sess) {
+            session_cache_put(conn->tls_key, sess);
+        }
+    }
+}
+
+// callback impelement
+#define _U_
+/*
+ * Write |length| bytes to the TLS connection and account for them.
+ * Returns what SSL_write() returned; on a blocked write conn->want_io
+ * tells which way.
+ */
+static int ssl_write_counted(struct connection_t *conn, const void *data,
+                             size_t length) {
+  struct pool_stats_t *stats = &conn->pool->stats;
+  uint64_t start_ns = conn->pool->opt->stats ? monotonic_ns() : 0;
+  int rv;
+
+  /* a stale WANT_READ from the last SSL_read must not pass for a block */
+  conn->want_io = IO_NONE;
+  ERR_clear_error();
+  rv = SSL_write(conn->ssl, data, (int)length);
+  stats->ssl_writes++;
+  if (start_ns) {
+    stats->write_ns += monotonic_ns() - start_ns;
+  }
+  if (rv <= 0) {
+    int err = SSL_get_error(conn->ssl, rv);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+      conn->want_io =
+          (err == SSL_ERROR_WANT_READ ? WANT_READ : WANT_WRITE);
+    }
+    return rv;
+  }
+  stats->bytes_out += (size_t)rv;
+  conn->written += (uint64_t)rv;
+  return rv;
+}
+
+/*
+ * Push the staged output of |conn| to the network as one TLS record.
+ * A blocked write leaves the buffer as is for the retry OpenSSL
+ * requires. Returns false only on a hard error.
+ */
+static bool connection_flush(struct connection_t *conn) {
+  int rv;
+
+  if (conn->outlen == 0) {
+    return true;
+  }
+  rv = ssl_write_counted(conn, conn->outbuf, conn->outlen);
+  if (rv <= 0) {
+    if (conn->want_io == IO_NONE) {
+      return false;
+    }
+    conn->out_blocked = true;
+    return true;
+  }
+  /* partial writes are not enabled, so the whole buffer went out */
+  conn->outlen = 0;
+  conn->out_blocked = false;
+  if (conn->want_io == WANT_WRITE) {
+    conn->want_io = IO_NONE;
+  }
+  loop_timer_stop(conn->pool->loop, &conn->flush_timer);
+  return true;
+}
+
+/*
+ * Append up to |length| bytes of |data| to the output buffer, flushing
+ * it whenever it fills up. Returns the number of bytes taken, or
+ * NGHTTP2_ERR_WOULDBLOCK / NGHTTP2_ERR_CALLBACK_FAILURE.
+ */
+static ssize_t connection_stage(struct connection_t *conn, const uint8_t *data,
+                                size_t length) {
+  size_t n;
+
+  if (conn->out_blocked || conn->outlen == OUTBUF_SIZE) {
+    if (!connection_flush(conn)) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    if (conn->outlen) {
+      return NGHTTP2_ERR_WOULDBLOCK;
+    }
+  }
+  n = OUTBUF_SIZE - conn->outlen;
+  if (n > length) {
+    n = length;
+  }
+  memcpy(conn->outbuf + conn->outlen, data, n);
+  conn->outlen += n;
+  conn->queued += n;
+  if (conn->outlen == OUTBUF_SIZE && !connection_flush(conn)) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  return (ssize_t)n;
+}
+
+/*
+ * The implementation of nghttp2_send_callback type. Here we stage
+ * |data| with size |length| in the connection's output buffer and
+ * return the number of bytes taken; it reaches the network once the
+ * buffer is full or nghttp2 has nothing more to send. See the
+ * documentation of nghttp2_send_callback for the details.
+ */
+static ssize_t send_callback(nghttp2_session *session _U_, const uint8_t *data,
+                             size_t length, int flags _U_, void *user_data) {
+
+  struct connection_t *conn = user_data;
+  conn->want_io = IO_NONE;
+  return connection_stage(conn, data, length);
+}
+
+/*
+ * The implementation of nghttp2_send_data_callback type, used for
+ * DATA frames whose read callback set NGHTTP2_DATA_FLAG_NO_COPY. The
+ * 9 byte frame header and a small payload are packed into the output
+ * buffer next to the HEADERS of the same stream; a payload slice of
+ * half a record or more is handed to SSL_write() straight from the
+ * payload, without staging it anywhere.
+ *
+ * A write may block in the middle of the frame. nghttp2 then calls us
+ * again with the same arguments, so conn->data_frame_sent records how
+ * far we got and a blocked direct write is retried as OpenSSL requires.
+ */
+static int send_data_callback(nghttp2_session *session _U_, nghttp2_frame *frame,
+                              const uint8_t *framehd, size_t length,
+                              nghttp2_data_source *source, void *user_data) {
+  static const uint8_t zeros[256];
+  struct connection_t *conn = user_data;
+  const uint8_t *data = source->ptr;
+  size_t padlen = frame->data.padlen;
+  uint8_t padlen_byte = (uint8_t)(padlen ? padlen - 1 : 0);
+  struct {
+    const uint8_t *p;
+    size_t n;
+  } seg[4] = {
+    { framehd, 9 },
+    { &padlen_byte, padlen > 0 ? 1 : 0 },
+    { data, length },
+    { zeros, padlen > 1 ? padlen - 1 : 0 }
+  };
+  size_t done = conn->data_frame_sent;
+  ssize_t rv;
+  int i;
+
+  conn->want_io = IO_NONE;
+  for (i = 0; i < 4; ) {
+    if (done >= seg[i].n) {
+      done -= seg[i].n;
+      i++;
+      continue;
+    }
+    if (seg[i].n - done >= OUTBUF_SIZE / 2) {
+      /* big slices skip the buffer; what is staged ahead goes first */
+      if (!connection_flush(conn)) {
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+      }
+      if (conn->outlen) {
+        return NGHTTP2_ERR_WOULDBLOCK;
+      }
+      rv = ssl_write_counted(conn, seg[i].p + done, seg[i].n - done);
+      if (rv <= 0) {
+        return conn->want_io == IO_NONE ? NGHTTP2_ERR_CALLBACK_FAILURE
+                                        : NGHTTP2_ERR_WOULDBLOCK;
+      }
+      conn->queued += (uint64_t)rv;
+    } else {
+      rv = connection_stage(conn, seg[i].p + done, seg[i].n - done);
+      if (rv < 0) {
+        return (int)rv;
+      }
+    }
+    conn->data_frame_sent += (size_t)rv;
+    done += (size_t)rv;
+  }
+
+  conn->data_frame_sent = 0;
+  source->ptr = (void *)(data + length);
+  return 0;
+}
+
+/*
+ * The implementation of nghttp2_recv_callback type. Here we read data
+ * from the network and write them in |buf|. The capacity of |buf| is
+ * |length| bytes. Returns the number of bytes stored in |buf|. See
+ * the documentation of nghttp2_recv_callback for the details.
+ */
+static ssize_t recv_callback(nghttp2_session *session _U_, uint8_t *buf,
+                             size_t length, int flags _U_, void *user_data) {
+
+  struct connection_t *conn;
+  int rv;
+  conn = (struct connection_t *)user_data;
+  conn->want_io = IO_NONE;
+  ERR_clear_error();
+  rv = SSL_read(conn->ssl, buf, (int)length);
+  if (rv < 0) {
+    int err = SSL_get_error(conn->ssl, rv);
+    if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+      conn->want_io =
+          (err == SSL_ERROR_WANT_READ ? WANT_READ : WANT_WRITE);
+      rv = NGHTTP2_ERR_WOULDBLOCK;
+    } else {
+      rv = NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+  } else if (rv == 0) {
+    rv = NGHTTP2_ERR_EOF;
+  }
+  return rv;
+}
+
+/* the plain text transcript of |st|, NULL when it is not kept */
+static struct buf_t*
+stream_text(struct stream_t *st)
+{
+  if (st == NULL || st->push || st->conn->pool->opt->json || st->conn->pool->opt->bench) {
+    return NULL;
+  }
+  return &st->text;
+}
+
+static bool
+text_header(struct buf_t *b, const uint8_t *name, size_t namelen,
+            const uint8_t *value, size_t valuelen)
+{
+  return buf_append(b, name, namelen) && buf_puts(b, ": ") &&
+         buf_append(b, value, valuelen) && buf_puts(b, "\n");
+}
+
+static int on_frame_send_callback(nghttp2_session *session,
+                                  const nghttp2_frame *frame,
+                                  void *user_data) {
+  struct connection_t *conn = user_data;
+  struct buf_t *text;
+  size_t i;
+  switch (frame->hd.type) {
+  case NGHTTP2_HEADERS:
+    debug("[INFO] C ----------------------------> S (HEADERS)\n");
+    conn->pool->stats.headers++;
+    conn->pool->stats.header_bytes += 9 + frame->hd.length;
+    text = stream_text(nghttp2_session_get_stream_user_data(session, frame->hd.stream_id));
+    if (text) {
+      const nghttp2_nv *nva = frame->headers.nva;
+      for (i = 0; i < frame->headers.nvlen; ++i) {
+        if (!text_header(text, nva[i].name, nva[i].namelen, nva[i].value, nva[i].valuelen)) {
+          return NGHTTP2_ERR_CALLBACK_FAILURE;
+        }
+      }
+    }
+    break;
+  case NGHTTP2_DATA:
+    if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+      struct stream_t *st = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+      debug("[INFO] C ----------------------------> S (DATA post body)\n");
+      if (st) {
+        /* the request is complete on the wire once written up to here */
+        st->sent_pos = conn->queued;
+      }
+      if ((text = stream_text(st)) != NULL &&
+          !(buf_append(text, st->payload, st->payload_len) && buf_puts(text, "\n"))) {
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+      }
+    }
+    break;
+  case NGHTTP2_RST_STREAM:
+    debug("[INFO] C ----------------------------> S (RST_STREAM)\n");
+    break;
+  case NGHTTP2_GOAWAY:
+    debug("[INFO] C ----------------------------> S (GOAWAY)\n");
+    break;
+  }
+  return 0;
+}
+
+static int on_frame_recv_callback(nghttp2_session *session,
+                                  const nghttp2_frame *frame,
+                                  void *user_data) {
+  switch (frame->hd.type) {
+  case NGHTTP2_HEADERS:
+    if (frame->headers.cat == NGHTTP2_HCAT_RESPONSE) {
+      if (nghttp2_session_get_stream_user_data(session, frame->hd.stream_id)) {
+	  debug("[INFO] C <---------------------------- S (HEADERS end)\n");
+      }
+    } else {
+	debug("other header: %d",frame->headers.cat);
+    }
+    break;
+  case NGHTTP2_SETTINGS:
+    if (!(frame->hd.flags & NGHTTP2_FLAG_ACK)) {
+      struct connection_t *conn = user_data;
+      if (!conn->settings_received) {
+        hist_record(&conn->pool->stats.hist[PHASE_SETTINGS], monotonic_us() - conn->open_us);
+      }
+      conn->settings_received = true;
+      debug("[INFO] C <---------------------------- S (SETTINGS max_concurrent_streams=%u)\n",
+            nghttp2_session_get_remote_settings(session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS));
+      pool_dispatch(conn->pool);
+    }
+    break;
+  case NGHTTP2_RST_STREAM:
+    debug("[INFO] C <---------------------------- S (RST_STREAM)\n");
+    break;
+  case NGHTTP2_GOAWAY:
+    debug("[INFO] C <---------------------------- S (GOAWAY)\n");
+    {
+      /* no new streams here; pool_pick() brings up a replacement in a
+         spare slot while this one drains */
+      struct connection_t *conn = user_data;
+      debug("[INFO] GOAWAY last stream %d, error %u\n", frame->goaway.last_stream_id,
+            frame->goaway.error_code);
+      conn->goaway = true;
+      conn->goaway_last_id = frame->goaway.last_stream_id;
+      pool_dispatch(conn->pool);
+      pool_refill(conn->pool, conn->tenant);
+    }
+    break;
+  case NGHTTP2_PING:
+    if (frame->hd.flags & NGHTTP2_FLAG_ACK) {
+      connection_ping_ack(user_data, frame->ping.opaque_data);
+    }
+    break;
+  }
+  return 0;
 }
 
 static int on_header_callback(nghttp2_session *session,
@@ -491,266 +3615,3789 @@ static int on_header_callback(nghttp2_session *session,
                               const uint8_t *value, size_t valuelen,
                               uint8_t flags, void *user_data) {
 
-  if (frame->hd.type == NGHTTP2_HEADERS) {
-        fwrite(name, namelen, 1, stdout);
-        printf(": ");
-        fwrite(value, valuelen, 1, stdout);
-        printf("\n");
+  if (frame->hd.type == NGHTTP2_HEADERS) {
+    struct stream_t *st = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    struct buf_t *text;
+    if (st == NULL) {
+      return 0;
+    }
+    stream_record_header(st, name, namelen, value, valuelen);
+    if ((text = stream_text(st)) != NULL &&
+        !text_header(text, name, namelen, value, valuelen)) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+  }
+  return 0;
+}
+
+static int on_begin_headers_callback(nghttp2_session *session,
+                                                 const nghttp2_frame *frame,
+                                                 void *user_data) {
+  struct stream_t *st = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  struct buf_t *text;
+  if (st && st->header_us == 0) {
+    st->header_us = monotonic_us();
+  }
+  if ((text = stream_text(st)) != NULL && !buf_puts(text, "\n")) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  debug("[INFO] C <---------------------------- S (HEADERS begin)\n");
+  return 0;
+}
+
+/*
+ * The implementation of nghttp2_on_stream_close_callback type. We use
+ * this function to know the response is fully received. A retryable
+ * failure goes back to the pool for another try later. The freed
+ * stream slot is refilled from the batch; once the batch is drained
+ * and the last stream has closed, pool_dispatch() sends GOAWAY and
+ * closes every session.
+ */
+static int on_stream_close_callback(nghttp2_session *session, int32_t stream_id,
+                                    uint32_t error_code,
+                                    void *user_data _U_) {
+  struct stream_t *st = nghttp2_session_get_stream_user_data(session, stream_id);
+  if (st) {
+    struct connection_t *conn = st->conn;
+    conn->inflight--;
+    if (error_code == NGHTTP2_REFUSED_STREAM && conn->goaway && stream_migrate(st)) {
+      /* above the GOAWAY last stream id: never processed */
+    } else if (stream_retryable(st, error_code)) {
+      stream_retry(st);
+    } else if (error_code != NGHTTP2_NO_ERROR) {
+      debug("[INFO] stream %d closed with error %u\n", stream_id, error_code);
+      conn->pool->batch->failed++;
+      stream_release(st, nghttp2_http2_strerror(error_code));
+    } else {
+      conn->pool->batch->completed++;
+      if (st->status / 100 == 2) {
+        bucket_ok(st->bucket);
+      } else {
+        stream_note_dead(st);
+      }
+      stream_release(st, NULL);
+    }
+    pool_dispatch(conn->pool);
+  }
+  return 0;
+}
+
+/*
+ * Request HEADERS that could not be sent, typically because GOAWAY
+ * arrived first, never open a stream, so on_stream_close_callback is
+ * not called for them. The server has not seen them: they move to
+ * another connection, or fail once moved too often.
+ */
+static int on_frame_not_send_callback(nghttp2_session *session,
+                                      const nghttp2_frame *frame,
+                                      int lib_error_code, void *user_data) {
+  struct connection_t *conn = user_data;
+  struct stream_t *st;
+  if (frame->hd.type == NGHTTP2_HEADERS &&
+      frame->headers.cat == NGHTTP2_HCAT_REQUEST &&
+      nghttp2_session_find_stream(session, frame->hd.stream_id) == NULL) {
+    debug("[INFO] stream %d not sent: %s\n", frame->hd.stream_id,
+          nghttp2_strerror(lib_error_code));
+    conn->inflight--;
+    for (st = conn->streams; st; st = st->next) {
+      if (st->stream_id == frame->hd.stream_id) {
+        if (!stream_migrate(st)) {
+          conn->pool->batch->failed++;
+          stream_release(st, nghttp2_strerror(lib_error_code));
+        }
+        break;
+      }
+    }
+    pool_dispatch(conn->pool);
+  }
+  return 0;
+}
+
+/*
+ * The implementation of nghttp2_on_data_chunk_recv_callback type. We
+ * use this function to keep the received response body, for the text
+ * output and to pick the reason out of it.
+ */
+static int on_data_chunk_recv_callback(nghttp2_session *session,
+                                       uint8_t flags _U_, int32_t stream_id,
+                                       const uint8_t *data, size_t len,
+                                       void *user_data _U_) {
+  debug("%s\n",__FUNCTION__);
+  struct stream_t *st = nghttp2_session_get_stream_user_data(session, stream_id);
+  struct buf_t *text;
+  if (st == NULL) {
+    return 0;
+  }
+  if ((text = stream_text(st)) != NULL &&
+      !(buf_append(text, data, len) && buf_puts(text, "\n"))) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  if (st->body.len + len > MAX_RESPONSE_BODY) {
+    return 0;
+  }
+  return buf_append(&st->body, data, len) ? 0 : NGHTTP2_ERR_CALLBACK_FAILURE;
+}
+
+/*
+ * Setup callback functions. nghttp2 API offers many callback
+ * functions, but most of them are optional. The send_callback is
+ * always required. Since we use nghttp2_session_recv(), the
+ * recv_callback is also required.
+ */
+static void
+setup_nghttp2_callbacks(nghttp2_session_callbacks *callbacks)
+{
+  nghttp2_session_callbacks_set_send_callback(callbacks, send_callback);
+  nghttp2_session_callbacks_set_send_data_callback(callbacks, send_data_callback);
+  nghttp2_session_callbacks_set_recv_callback(callbacks, recv_callback);
+  nghttp2_session_callbacks_set_on_frame_send_callback(callbacks, on_frame_send_callback);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv_callback);
+  nghttp2_session_callbacks_set_on_header_callback(callbacks,on_header_callback);
+  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks,on_begin_headers_callback);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close_callback);
+  nghttp2_session_callbacks_set_on_frame_not_send_callback(callbacks, on_frame_not_send_callback);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv_callback);
+
+}
+
+static bool
+set_nghttp2_session_info(struct connection_t *conn)
+{
+    int rv;
+    nghttp2_session_callbacks *callbacks;
+
+    rv = nghttp2_session_callbacks_new(&callbacks);
+    if (rv != 0) {
+        fprintf(stderr, "nghttp2_session_callbacks_new");
+    }
+    setup_nghttp2_callbacks(callbacks);
+    rv = nghttp2_session_client_new3(&conn->session, callbacks, conn, NULL,
+                                     &conn->pool->mem.hooks);
+    if (rv != 0) {
+        fprintf(stderr, "nghttp2_session_client_new");
+    }
+    nghttp2_session_callbacks_del(callbacks);
+
+    rv = nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, NULL, 0);
+    if (rv != 0) {
+	fprintf(stderr, "nghttp2_submit_settings %d",rv);
+    }
+    return true;
+}
+
+static int
+set_tcp_nodelay(int fd)
+{
+    int val = 1;
+    if(-1 == setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, (socklen_t)sizeof(val))) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The request body is never copied into nghttp2's buffer: we only
+ * report how much of the payload fits in the next DATA frame and set
+ * NGHTTP2_DATA_FLAG_NO_COPY, send_data_callback() writes it out.
+ * |source->ptr| is the stream's cursor into its body and payloads
+ * larger than one frame simply take several rounds.
+ */
+ssize_t data_prd_read_callback(
+    nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+    uint32_t *data_flags, nghttp2_data_source *source, void *user_data) {
+
+  const struct stream_t *st = nghttp2_session_get_stream_user_data(session, stream_id);
+  const char *end = st->payload + st->payload_len;
+  size_t left = (size_t)(end - (const char *)source->ptr);
+
+  *data_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
+  if (left <= length) {
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    return (ssize_t)left;
+  }
+  return (ssize_t)length;
+}
+
+/*
+ * Submit |st| on |conn|. A -daemon request brings its own headers; an
+ * apns-topic among them replaces the default topic. With -p8 the
+ * current provider token goes along as authorization.
+ *
+ * Only the :path value is copied by nghttp2, everything else outlives
+ * the HEADERS frame. The path carries the device token and is never
+ * repeated, so it is sent without indexing and leaves the HPACK
+ * dynamic table to the headers that are.
+ */
+static int32_t
+submit_request(struct connection_t *conn, const struct opt_t* opt, const char *path,
+               size_t path_len, struct stream_t *st)
+{
+    int32_t stream_id;
+    nghttp2_nv nva[4 + MAX_PUSH_HEADERS] = {
+        opt->headers[0],
+        {
+            (uint8_t *)":path", (uint8_t *)path, 5, path_len,
+            NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_INDEX
+        },
+        opt->headers[1]
+    };
+    size_t i, nvlen = 3;
+
+    if (opt->p8) {
+        /* one signed token for every stream, nothing to copy */
+        const struct jwt_token_t *jwt =
+            atomic_load_explicit(&g_jwt.current, memory_order_acquire);
+        nghttp2_nv auth = {
+            (uint8_t *)"authorization", (uint8_t *)jwt->value, 13, jwt->len,
+            NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE
+        };
+        nva[nvlen++] = auth;
+    }
+
+    if (st->push) {
+        for (i = 0; i < st->push->nheaders; i++) {
+            const nghttp2_nv *h = &st->push->headers[i];
+            if (h->namelen == 10 && memcmp(h->name, "apns-topic", 10) == 0) {
+                nva[2] = *h;
+            } else {
+                nva[nvlen++] = *h;
+            }
+        }
+    }
+
+    nghttp2_data_provider data_prd;
+    data_prd.source.ptr = (void*)st->payload;
+    data_prd.read_callback = data_prd_read_callback;
+
+    stream_id = nghttp2_submit_request(conn->session, NULL, nva, nvlen, &data_prd, st);
+    return stream_id;
+}
+
+static bool
+spsc_init(struct spsc_ring_t *ring, size_t size, size_t stride)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->mask = size - 1;
+    ring->stride = stride;
+    ring->items = malloc(size * stride);
+    return ring->items != NULL;
+}
+
+/*
+ * Copy |len| bytes of |item| into the next free slot, NUL terminated
+ * when shorter than the slot. Returns false while the ring is full.
+ */
+static bool
+spsc_push(struct spsc_ring_t *ring, const void *item, size_t len)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint8_t *slot;
+
+    if (tail - head > ring->mask) {
+        return false;
+    }
+    slot = ring->items + (tail & ring->mask) * ring->stride;
+    memcpy(slot, item, len);
+    if (len < ring->stride) {
+        slot[len] = 0;
+    }
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/* the oldest item, NULL while the ring is empty; spsc_pop() frees it */
+static const void*
+spsc_peek(struct spsc_ring_t *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) {
+        return NULL;
+    }
+    return ring->items + (head & ring->mask) * ring->stride;
+}
+
+static void
+spsc_pop(struct spsc_ring_t *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    /* seq_cst pairs with the reader's store to feeder->waiting */
+    atomic_store(&ring->head, head + 1);
+}
+
+static bool
+spsc_full(struct spsc_ring_t *ring)
+{
+    return atomic_load(&ring->tail) - atomic_load(&ring->head) > ring->mask;
+}
+
+static void
+eventfd_kick(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+}
+
+/*
+ * Worker side of batch_next_line(): take the next item off the queue,
+ * a binary token or with -template a -tokens line, into w->line. The
+ * batch only ends once the reader has flagged the end of input and the
+ * queue has been drained.
+ */
+static bool
+worker_next_line(struct worker_t *w, const char **line, size_t *len)
+{
+    const void *item = spsc_peek(&w->ring);
+
+    if (item == NULL && atomic_load_explicit(&w->input_done, memory_order_acquire)) {
+        /* input_done is set after the last push: empty now means done */
+        if ((item = spsc_peek(&w->ring)) == NULL) {
+            w->batch.eof = true;
+        }
+    }
+    if (item == NULL) {
+        return false;
+    }
+    if (w->pool.opt->tpl) {
+        snprintf(w->line, sizeof(w->line), "%s", (const char *)item);
+    } else {
+        token_format(item, w->line);
+    }
+    spsc_pop(&w->ring);
+    if (atomic_load(&w->feeder->waiting)) {
+        eventfd_kick(w->feeder->space_fd);
+    }
+    *line = w->line;
+    *len = strlen(w->line);
+    return true;
+}
+
+/*
+ * The next line of the batch: the single -token, the next non-blank
+ * -tokens line without surrounding whitespace, or what the reader
+ * thread queued for this worker. Not NUL terminated.
+ */
+static bool
+batch_next_line(struct batch_t *batch, const char **line, size_t *len)
+{
+    if (batch->eof) {
+        return false;
+    }
+    if (batch->worker) {
+        return worker_next_line(batch->worker, line, len);
+    }
+    if (batch->in == NULL) {
+        /* single -token mode */
+        batch->eof = true;
+        *line = batch->opt->token;
+        *len = strlen(batch->opt->token);
+        return true;
+    }
+    if (input_next(batch->in, line, len)) {
+        return true;
+    }
+    batch->eof = true;
+    return false;
+}
+
+/* with -dedup, a token read before in this batch is dropped */
+static bool
+batch_duplicate(struct batch_t *batch, const struct token_t *token)
+{
+    if (batch->seen == NULL || token_set_add(batch->seen, token)) {
+        return false;
+    }
+    batch->duplicates++;
+    return true;
+}
+
+/* a token that is not 64 hex digits is not worth a round trip */
+static void
+batch_reject_token(struct batch_t *batch, const char *token, size_t len)
+{
+    fprintf(stderr, "invalid token skipped: %.*s\n", (int)(len < 80 ? len : 80), token);
+    batch->failed++;
+}
+
+/*
+ * How many streams we may keep open on |conn|. Until the server's
+ * SETTINGS frame arrives only one stream is opened, since APNs starts
+ * out allowing a single stream and raises the limit afterwards.
+ */
+static uint32_t
+stream_limit(struct connection_t *conn)
+{
+    uint32_t limit;
+    if (!conn->settings_received) {
+        return 1;
+    }
+    limit = nghttp2_session_get_remote_settings(conn->session,
+                                                NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+    return limit < MAX_INFLIGHT_STREAMS ? limit : MAX_INFLIGHT_STREAMS;
+}
+
+/* connections that take new streams */
+static bool
+connection_usable(const struct connection_t *conn)
+{
+    return conn->session && !conn->goaway && !conn->closing;
+}
+
+/*
+ * Round trip time of |conn| as far as we know it: the smoothed PING
+ * round trip, or how long an outstanding PING has been waiting if that
+ * is longer already. 0 until the first PING is answered.
+ */
+static uint64_t
+connection_rtt(const struct connection_t *conn)
+{
+    uint64_t now_us = conn->pool->loop->now * 1000;
+
+    if (conn->ping_sent_us && now_us > conn->ping_sent_us &&
+        now_us - conn->ping_sent_us > conn->rtt_us) {
+        return now_us - conn->ping_sent_us;
+    }
+    return conn->rtt_us;
+}
+
+/* made with a certificate that has been reloaded since */
+static bool
+connection_stale(const struct connection_t *conn)
+{
+    return conn->generation != conn->tenant->generation;
+}
+
+/*
+ * Every tenant has 2 * pool->target slots of its own, in the order of
+ * g_tenants; requests only go to their tenant's connections.
+ */
+static struct connection_t*
+pool_slots(struct pool_t *pool, const struct tenant_t *tenant)
+{
+    return &pool->conns[tenant->index * 2 * pool->target];
+}
+
+/*
+ * Start connecting a free slot of |tenant|; it takes requests once the
+ * loop has set it up. NULL when no slot could be started.
+ */
+static struct connection_t*
+pool_connect(struct pool_t *pool, struct tenant_t *tenant)
+{
+    struct connection_t *conns = pool_slots(pool, tenant);
+    int i;
+
+    for (i = 0; i < 2 * pool->target; i++) {
+        struct connection_t *conn = &conns[i];
+        if (conn->session || conn->connecting ||
+            conn->reconnect_tries >= MAX_RECONNECT_TRIES) {
+            continue;
+        }
+        pool->stats.reconnects++;
+        debug("[INFO] reconnecting slot %d\n", conn->index);
+        if (connection_start(conn)) {
+            return conn;
+        }
+        conn->reconnect_tries++;
+    }
+    return NULL;
+}
+
+/* slots of |tenant| being connected */
+static int
+pool_connecting(struct pool_t *pool, const struct tenant_t *tenant)
+{
+    struct connection_t *conns = pool_slots(pool, tenant);
+    int i, n = 0;
+
+    for (i = 0; i < 2 * pool->target; i++) {
+        if (conns[i].connecting) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/* connections of |tenant| taking streams, not counting stale ones */
+static int
+pool_live(struct pool_t *pool, const struct tenant_t *tenant)
+{
+    struct connection_t *conns = pool_slots(pool, tenant);
+    int i, live = 0;
+
+    for (i = 0; i < 2 * pool->target; i++) {
+        if (connection_usable(&conns[i]) && !connection_stale(&conns[i])) {
+            live++;
+        }
+    }
+    return live;
+}
+
+/* |tenant| has a connection, in whatever state, or one on the way */
+static bool
+pool_tenant_active(struct pool_t *pool, const struct tenant_t *tenant)
+{
+    struct connection_t *conns = pool_slots(pool, tenant);
+    int i;
+
+    for (i = 0; i < 2 * pool->target; i++) {
+        if (conns[i].session || conns[i].connecting) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Pick the connection of |tenant| with the most free stream slots,
+ * leaving out degraded ones (a round trip RTT_DEGRADED_FACTOR times the
+ * best one) and those made with a since reloaded certificate while
+ * others have room. Connections that received GOAWAY or are shutting
+ * down take no new streams. While fewer than pool->target connections
+ * take streams or are being set up, a free slot starts connecting, so
+ * a draining connection is replaced before it is gone. Returns NULL
+ * when no connection can take another stream right now.
+ */
+static struct connection_t*
+pool_pick(struct pool_t *pool, struct tenant_t *tenant)
+{
+    struct connection_t *conns = pool_slots(pool, tenant);
+    struct connection_t *best = NULL, *conn;
+    uint32_t best_free = 0;
+    uint64_t rtt, min_rtt = 0;
+    bool degraded, best_degraded = false;
+    int i, live = 0;
+
+    for (i = 0; i < 2 * pool->target; i++) {
+        conn = &conns[i];
+        if (!connection_usable(conn)) {
+            continue;
+        }
+        if (!connection_stale(conn)) {
+            live++;
+        }
+        rtt = connection_rtt(conn);
+        if (rtt && (min_rtt == 0 || rtt < min_rtt)) {
+            min_rtt = rtt;
+        }
+    }
+    for (i = 0; i < 2 * pool->target; i++) {
+        uint32_t limit;
+
+        conn = &conns[i];
+        if (!connection_usable(conn)) {
+            continue;
+        }
+        limit = stream_limit(conn);
+        if (conn->inflight >= limit) {
+            continue;
+        }
+        rtt = connection_rtt(conn);
+        degraded = connection_stale(conn) ||
+                   (live > 1 && rtt > min_rtt * RTT_DEGRADED_FACTOR &&
+                    rtt - min_rtt > RTT_DEGRADED_MIN_US);
+        if (best == NULL || degraded < best_degraded ||
+            (degraded == best_degraded && limit - conn->inflight > best_free)) {
+            best = conn;
+            best_free = limit - conn->inflight;
+            best_degraded = degraded;
+        }
+    }
+    if (live + pool_connecting(pool, tenant) < pool->target) {
+        pool_connect(pool, tenant);
+    }
+    return best;
+}
+
+/*
+ * Bring |tenant| back to pool->target usable connections after one
+ * went away, so the next request does not wait for a handshake. Not
+ * once the batch is done.
+ */
+static void
+pool_refill(struct pool_t *pool, struct tenant_t *tenant)
+{
+    int live;
+
+    if (pool->batch->eof) {
+        return;
+    }
+    live = pool_live(pool, tenant) + pool_connecting(pool, tenant);
+    while (live < pool->target && pool_connect(pool, tenant) != NULL) {
+        live++;
+    }
+}
+
+/* end |conn| once its streams are done: GOAWAY, then close */
+static void
+connection_terminate(struct connection_t *conn)
+{
+    int rv;
+
+    conn->closing = true;
+    conn->dirty = true;
+    rv = nghttp2_session_terminate_session(conn->session, NGHTTP2_NO_ERROR);
+    if (rv != 0) {
+        diec("nghttp2_session_terminate_session", rv);
+    }
+}
+
+/*
+ * After a certificate reload: close connections made with the old one
+ * as they go idle, once their tenant has a current one to take over.
+ */
+static void
+pool_retire_stale(struct pool_t *pool)
+{
+    bool stale = false;
+    int i;
+
+    for (i = 0; i < pool->size; i++) {
+        struct connection_t *conn = &pool->conns[i];
+        if (conn->session == NULL || conn->closing || !connection_stale(conn)) {
+            continue;
+        }
+        stale = true;
+        if (conn->inflight == 0 && pool_live(pool, conn->tenant) > 0) {
+            debug("[INFO] closing connection %d, its certificate was reloaded\n", conn->index);
+            connection_terminate(conn);
+        }
+    }
+    pool->retiring = stale;
+}
+
+static bool
+pool_active(const struct pool_t *pool)
+{
+    int i;
+    for (i = 0; i < pool->size; i++) {
+        if (pool->conns[i].session || pool->conns[i].connecting) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t
+pool_inflight(const struct pool_t *pool)
+{
+    uint32_t n = 0;
+    int i;
+    for (i = 0; i < pool->size; i++) {
+        n += pool->conns[i].inflight;
+    }
+    return n;
+}
+
+static void
+stream_record_header(struct stream_t *st, const uint8_t *name, size_t namelen,
+                     const uint8_t *value, size_t valuelen)
+{
+    if (namelen == 7 && memcmp(name, ":status", 7) == 0) {
+        st->status = atoi((const char *)value);
+    } else if (namelen == 7 && memcmp(name, "apns-id", 7) == 0 &&
+               valuelen < sizeof(st->apns_id)) {
+        memcpy(st->apns_id, value, valuelen);
+        st->apns_id[valuelen] = 0;
+    }
+}
+
+/* the raw value of member |name| of an APNs error body */
+static bool
+stream_body_member(const struct stream_t *st, const char *name, const char **v,
+                   const char **ve)
+{
+    const char *p = st->body.data;
+    const char *e = p + st->body.len;
+    char key[32];
+
+    if (st->body.len == 0) {
+        return false;
+    }
+    p = json_ws(p, e);
+    if (p >= e || *p != '{') {
+        return false;
+    }
+    p++;
+    while (json_next_member(&p, e, key, sizeof(key), v, ve) == 1) {
+        if (string_eq(key, name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* the "reason" member of an APNs error body, if there is one */
+static char*
+stream_reason(const struct stream_t *st)
+{
+    const char *v, *ve;
+
+    if (!stream_body_member(st, "reason", &v, &ve)) {
+        return NULL;
+    }
+    return json_string(v, ve, NULL);
+}
+
+/*
+ * A 410 (Unregistered, ExpiredToken) or 400 BadDeviceToken answer goes
+ * into -dead-tokens, with the "timestamp" of a 410 when there is one.
+ */
+static void
+stream_note_dead(const struct stream_t *st)
+{
+    struct token_t token;
+    const char *v, *ve;
+    uint64_t since_ms = 0;
+    char *reason;
+
+    if (atomic_load(&g_dead.table) == NULL || (st->status != 410 && st->status != 400) ||
+        !token_parse(st->token, strlen(st->token), &token)) {
+        return;
+    }
+    if (st->status == 400) {
+        bool bad = (reason = stream_reason(st)) != NULL && string_eq(reason, "BadDeviceToken");
+        free(reason);
+        if (!bad) {
+            return;
+        }
+    } else if (stream_body_member(st, "timestamp", &v, &ve)) {
+        since_ms = strtoull(v, NULL, 10);
+    }
+    dead_store_add(&token, since_ms ? since_ms : realtime_ms());
+}
+
+/*
+ * Append one result line for |token| to |b|:
+ *   {"id":..,"token":"..","status":200,"apns-id":"..","reason":"..",
+ *    "error":"..","retries":..,"header_us":..,"total_us":..}
+ * |id| is raw JSON and may be NULL, as may |st| for a request that
+ * never got a stream. Members without a value are left out.
+ */
+static bool
+result_json(struct buf_t *b, const struct stream_t *st, const char *id,
+            const char *token, const char *error)
+{
+    char num[64];
+    char *reason;
+    bool ok = buf_puts(b, "{");
+
+    if (id) {
+        ok = ok && buf_puts(b, "\"id\":") && buf_puts(b, id) && buf_puts(b, ",");
+    }
+    ok = ok && buf_puts(b, "\"token\":") &&
+         buf_json_string(b, token ? token : "", token ? strlen(token) : 0);
+    if (st && st->status) {
+        snprintf(num, sizeof(num), ",\"status\":%d", st->status);
+        ok = ok && buf_puts(b, num);
+    }
+    if (st && st->apns_id[0]) {
+        ok = ok && buf_puts(b, ",\"apns-id\":") &&
+             buf_json_string(b, st->apns_id, strlen(st->apns_id));
+    }
+    if (st && (reason = stream_reason(st)) != NULL) {
+        ok = ok && buf_puts(b, ",\"reason\":") && buf_json_string(b, reason, strlen(reason));
+        free(reason);
+    }
+    if (error) {
+        ok = ok && buf_puts(b, ",\"error\":") && buf_json_string(b, error, strlen(error));
+    }
+    if (st && st->retries) {
+        snprintf(num, sizeof(num), ",\"retries\":%d", st->retries);
+        ok = ok && buf_puts(b, num);
+    }
+    if (st && st->header_us) {
+        snprintf(num, sizeof(num), ",\"header_us\":%llu,\"total_us\":%llu",
+                 (unsigned long long)(st->header_us - st->submit_us),
+                 (unsigned long long)(monotonic_us() - st->submit_us));
+        ok = ok && buf_puts(b, num);
+    }
+    return ok && buf_puts(b, "}\n");
+}
+
+/*
+ * Queue |len| bytes holding |records| whole results on |r|. A full
+ * ring blocks the pool until the output thread makes room, or with
+ * -output-full drop, the results are counted and thrown away.
+ */
+static void
+sink_put(struct sink_ring_t *r, const char *data, size_t len, uint64_t records)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t off, first;
+    uint64_t v;
+
+    while (r->size - (tail - atomic_load_explicit(&r->head, memory_order_acquire)) < len) {
+        if (g_sink.drop || len > r->size) {
+            r->dropped += records;
+            return;
+        }
+        atomic_store(&r->waiting, true);
+        if (r->size - (tail - atomic_load(&r->head)) >= len) {
+            atomic_store(&r->waiting, false);
+            break;
+        }
+        while (read(r->space_fd, &v, sizeof(v)) == -1 && errno == EINTR)
+            ;
+    }
+    off = tail & (r->size - 1);
+    first = len < r->size - off ? len : r->size - off;
+    memcpy(r->data + off, data, first);
+    memcpy(r->data, data + first, len - first);
+    /* seq_cst, so the output thread going to sleep sees it or is kicked */
+    atomic_store(&r->tail, tail + len);
+    if (!atomic_load(&g_sink.notified) && !atomic_exchange(&g_sink.notified, true)) {
+        eventfd_kick(g_sink.wake_fd);
+    }
+}
+
+/* hand everything collected in |w| to the output thread */
+static void
+writer_flush(struct writer_t *w)
+{
+    if (w->buf.len == 0) {
+        return;
+    }
+    sink_put(w->ring, w->buf.data, w->buf.len, w->records);
+    w->buf.len = 0;
+    w->records = 0;
+}
+
+/* <file> becomes <file>.1, the older ones move up and the last goes */
+static void
+sink_rotate()
+{
+    char from[PATH_MAX], to[PATH_MAX];
+    int i, fd;
+
+    for (i = SINK_KEEP - 1; i >= 1; i--) {
+        snprintf(from, sizeof(from), "%s.%d", g_sink.path, i);
+        snprintf(to, sizeof(to), "%s.%d", g_sink.path, i + 1);
+        rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", g_sink.path);
+    if (rename(g_sink.path, to) != 0 ||
+        (fd = open(g_sink.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "-output: rotate %s fail: %s\n", g_sink.path, strerror(errno));
+        return;
+    }
+    close(g_sink.fd);
+    g_sink.fd = fd;
+    g_sink.written = 0;
+}
+
+/* write |iov| out in full; after an error the rest of the output is discarded */
+static void
+sink_write(struct iovec *iov, int n, size_t total)
+{
+    ssize_t w;
+
+    if (g_sink.failed) {
+        return;
+    }
+    if (g_sink.rotate && g_sink.written > 0 && g_sink.written + total > g_sink.rotate) {
+        sink_rotate();
+    }
+    g_sink.written += total;
+    while (n > 0) {
+        w = writev(g_sink.fd, iov, n < IOV_MAX ? n : IOV_MAX);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "-output: write fail: %s, discarding results\n", strerror(errno));
+            g_sink.failed = true;
+            return;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+}
+
+/*
+ * Output thread: every round takes what all rings hold, at most
+ * SINK_MAX_IOV pieces, and writes it with one writev(). After a small
+ * round it waits SINK_LINGER_MS for more rather than write again right
+ * away; pools only kick it once it found nothing and went to sleep.
+ */
+static void*
+sink_main(void *arg)
+{
+    struct iovec iov[SINK_MAX_IOV];
+    size_t taken[MAX_THREADS];
+    struct timespec linger = { 0, SINK_LINGER_MS * 1000000L };
+    uint64_t v;
+    int i, n;
+
+    for (;;) {
+        size_t total = 0;
+
+        n = 0;
+        for (i = 0; i < g_sink.nrings && n + 2 <= SINK_MAX_IOV; i++) {
+            struct sink_ring_t *r = &g_sink.rings[i];
+            size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            size_t avail = atomic_load(&r->tail) - head;
+            size_t off = head & (r->size - 1);
+            size_t first = avail < r->size - off ? avail : r->size - off;
+
+            taken[i] = avail;
+            if (avail == 0) {
+                continue;
+            }
+            iov[n].iov_base = r->data + off;
+            iov[n++].iov_len = first;
+            if (avail > first) {
+                iov[n].iov_base = r->data;
+                iov[n++].iov_len = avail - first;
+            }
+            total += avail;
+        }
+        for (; i < g_sink.nrings; i++) {
+            taken[i] = 0;
+        }
+
+        if (total > 0) {
+            sink_write(iov, n, total);
+            for (i = 0; i < g_sink.nrings; i++) {
+                struct sink_ring_t *r = &g_sink.rings[i];
+                if (taken[i] == 0) {
+                    continue;
+                }
+                /* seq_cst, against a pool about to wait for room */
+                atomic_fetch_add(&r->head, taken[i]);
+                if (atomic_load(&r->waiting)) {
+                    atomic_store(&r->waiting, false);
+                    eventfd_kick(r->space_fd);
+                }
+            }
+            if (total < WRITER_SIZE && !atomic_load(&g_sink.stop)) {
+                nanosleep(&linger, NULL);
+            }
+            continue;
+        }
+        if (atomic_load(&g_sink.stop)) {
+            break;
+        }
+        /* cleared before looking again, so a pool queuing now kicks us */
+        atomic_store(&g_sink.notified, false);
+        for (i = 0; i < g_sink.nrings; i++) {
+            if (atomic_load(&g_sink.rings[i].tail) != atomic_load(&g_sink.rings[i].head)) {
+                break;
+            }
+        }
+        if (i == g_sink.nrings) {
+            while (read(g_sink.wake_fd, &v, sizeof(v)) == -1 && errno == EINTR)
+                ;
+        }
+    }
+    return NULL;
+}
+
+/* the output thread, with one ring for each of |nrings| pools */
+static void
+sink_open(const struct opt_t *opt, int nrings)
+{
+    struct stat sb;
+    int i;
+
+    bzero(&g_sink, sizeof(g_sink));
+    g_sink.drop = opt->output_drop;
+    g_sink.rotate = (uint64_t)opt->output_rotate * 1024 * 1024;
+    g_sink.fd = STDOUT_FILENO;
+    if (opt->output && !string_eq(opt->output, "-")) {
+        g_sink.path = opt->output;
+        g_sink.fd = open(g_sink.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (g_sink.fd < 0) {
+            fprintf(stderr, "-output: open %s fail: %s\n", g_sink.path, strerror(errno));
+            exit(1);
+        }
+        if (fstat(g_sink.fd, &sb) == 0) {
+            g_sink.written = (uint64_t)sb.st_size;
+        }
+    } else {
+        /* rotating stdout makes no sense */
+        g_sink.rotate = 0;
+    }
+    atomic_init(&g_sink.notified, false);
+    atomic_init(&g_sink.stop, false);
+    atomic_init(&g_sink.closed, false);
+    g_sink.wake_fd = eventfd(0, EFD_CLOEXEC);
+    g_sink.rings = calloc((size_t)nrings, sizeof(struct sink_ring_t));
+    if (g_sink.wake_fd < 0 || g_sink.rings == NULL) {
+        die("output thread init fail.");
+    }
+    g_sink.nrings = nrings;
+    for (i = 0; i < nrings; i++) {
+        struct sink_ring_t *r = &g_sink.rings[i];
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        atomic_init(&r->waiting, false);
+        r->size = SINK_RING_SIZE;
+        r->data = malloc(r->size);
+        r->space_fd = eventfd(0, EFD_CLOEXEC);
+        if (r->data == NULL || r->space_fd < 0) {
+            die("output thread init fail.");
+        }
+    }
+    /* what stdio holds, the usage or a blank line, goes first */
+    fflush(stdout);
+    if (helper_thread_create(&g_sink.thread, sink_main, NULL) != 0) {
+        die("pthread_create fail.");
+    }
+    g_sink.started = true;
+}
+
+/*
+ * Let the thread write what the rings hold and wait for it to end;
+ * also from die(), where other pools may still be running, so nothing
+ * is freed here. Only the first caller does it.
+ */
+static void
+sink_stop()
+{
+    if (!g_sink.started || atomic_exchange(&g_sink.closed, true)) {
+        return;
+    }
+    atomic_store(&g_sink.stop, true);
+    eventfd_kick(g_sink.wake_fd);
+    pthread_join(g_sink.thread, NULL);
+}
+
+/* once the pools are done: write what is left and stop the thread */
+static void
+sink_close()
+{
+    uint64_t dropped = 0;
+    int i;
+
+    if (g_sink.rings == NULL) {
+        return;
+    }
+    sink_stop();
+    for (i = 0; i < g_sink.nrings; i++) {
+        dropped += g_sink.rings[i].dropped;
+        free(g_sink.rings[i].data);
+        close(g_sink.rings[i].space_fd);
+    }
+    if (dropped) {
+        fprintf(stderr, "output: %llu results dropped, the output could not keep up\n",
+                (unsigned long long)dropped);
+    }
+    free(g_sink.rings);
+    g_sink.rings = NULL;
+    close(g_sink.wake_fd);
+    if (g_sink.path) {
+        close(g_sink.fd);
+    }
+}
+
+/* the result of a batch mode stream: a JSON line with -json, else its transcript */
+static void
+stream_emit(struct stream_t *st, const char *error)
+{
+    const struct opt_t *opt = st->conn->pool->opt;
+    struct writer_t *w = &st->conn->pool->out;
+    bool ok = true;
+
+    if (opt->bench && !opt->json) {
+        return;
+    }
+    w->records++;
+    if (opt->json) {
+        ok = result_json(&w->buf, st, NULL, st->token, error);
+    } else {
+        if (st->text.len > 0) {
+            ok = buf_append(&w->buf, st->text.data, st->text.len);
+        }
+        if (error) {
+            ok = ok && buf_puts(&w->buf, "error: ") && buf_puts(&w->buf, error) &&
+                 buf_puts(&w->buf, "\n");
+        }
+    }
+    if (!ok) {
+        die("alloc output fail.");
+    }
+    if (w->buf.len >= WRITER_SIZE) {
+        writer_flush(w);
+    }
+}
+
+/* link |st| on |conn|, the connection it is sent on */
+static void
+stream_attach(struct connection_t *conn, struct stream_t *st)
+{
+    st->conn = conn;
+    st->prev = NULL;
+    st->next = conn->streams;
+    if (conn->streams) {
+        conn->streams->prev = st;
+    }
+    conn->streams = st;
+}
+
+static void
+stream_detach(struct stream_t *st)
+{
+    if (st->prev) {
+        st->prev->next = st->next;
+    } else {
+        st->conn->streams = st->next;
+    }
+    if (st->next) {
+        st->next->prev = st->prev;
+    }
+    st->prev = st->next = NULL;
+}
+
+/*
+ * Streams come from the pool's free list when it has one. A reused
+ * stream keeps the memory of its response buffers, only the fixed part
+ * is cleared; a rendered payload is always written over.
+ */
+static struct stream_t*
+stream_new(struct connection_t *conn, const char *token, const char *payload,
+           size_t payload_len, struct push_t *push)
+{
+    struct mem_pool_t *m = &conn->pool->mem;
+    struct stream_t *st = m->streams;
+
+    if (st) {
+        struct buf_t body = st->body;
+        struct buf_t text = st->text;
+        m->streams = st->next;
+        m->nstreams--;
+        bzero(st, sizeof(*st));
+        st->body.data = body.data;
+        st->body.cap = body.cap;
+        st->text.data = text.data;
+        st->text.cap = text.cap;
+    } else {
+        st = calloc(1, sizeof(*st) + (conn->pool->opt->tpl ? MAX_PAYLOAD_LEN : 0));
+        if (st == NULL) {
+            die("alloc stream fail.");
+        }
+    }
+    st->conn = conn;
+    snprintf(st->token, sizeof(st->token), "%s", token);
+    st->payload = payload;
+    st->payload_len = payload_len;
+    st->push = push;
+    st->submit_us = monotonic_us();
+    stream_attach(conn, st);
+    return st;
+}
+
+static void
+stream_free(struct mem_pool_t *m, struct stream_t *st)
+{
+    if (m->nstreams < MAX_INFLIGHT_STREAMS && st->body.cap <= MAX_RESPONSE_BODY &&
+        st->text.cap <= WRITER_SIZE) {
+        st->next = m->streams;
+        m->streams = st;
+        m->nstreams++;
+        return;
+    }
+    buf_free(&st->body);
+    buf_free(&st->text);
+    free(st);
+}
+
+/* give back everything cached, once no session of the pool is left */
+static void
+mem_pool_destroy(struct mem_pool_t *m)
+{
+    struct mem_block_t *b;
+    struct stream_t *st;
+    int c;
+
+    for (c = 0; c < MEM_CLASSES; c++) {
+        while ((b = m->free[c]) != NULL) {
+            m->free[c] = b->next;
+            free(b);
+        }
+        m->nfree[c] = 0;
+    }
+    while ((st = m->streams) != NULL) {
+        m->streams = st->next;
+        buf_free(&st->body);
+        buf_free(&st->text);
+        free(st);
+    }
+    m->nstreams = 0;
+}
+
+/*
+ * The request is done with, successfully when |error| is NULL. Its
+ * result is written out here, or a -daemon request gets its answer.
+ */
+static void
+stream_finish(struct stream_t *st, const char *error)
+{
+    struct connection_t *conn = st->conn;
+
+    if (st->header_us && !st->warmup) {
+        struct pool_stats_t *stats = &conn->pool->stats;
+        hist_record(&stats->hist[PHASE_HEADER], st->header_us - st->submit_us);
+        hist_record(&stats->hist[PHASE_TOTAL], monotonic_us() - st->submit_us);
+    }
+    if (error == NULL && !st->warmup) {
+        conn->pool->stats.completed++;
+    }
+    if (st->push) {
+        daemon_reply(st->push, st, error);
+    } else {
+        stream_emit(st, error);
+    }
+    stream_free(&conn->pool->mem, st);
+}
+
+/* the stream on its connection is done with, see stream_finish() */
+static void
+stream_release(struct stream_t *st, const char *error)
+{
+    stream_detach(st);
+    stream_finish(st, error);
+}
+
+/* xorshift64*, one per pool so that threads share no state */
+static uint64_t
+pool_random(struct pool_t *pool)
+{
+    uint64_t x = pool->rng;
+
+    if (x == 0) {
+        x = (monotonic_ns() ^ ((uint64_t)(pool->worker + 2) << 40)) | 1;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    pool->rng = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* the apns-topic a request goes out with */
+static const char*
+push_topic(const struct opt_t *opt, const struct push_t *push)
+{
+    size_t i;
+
+    for (i = 0; push && i < push->nheaders; i++) {
+        if (push->headers[i].namelen == 10 &&
+            memcmp(push->headers[i].name, "apns-topic", 10) == 0) {
+            return (const char *)push->headers[i].value;
+        }
+    }
+    return opt->topic ? opt->topic : "";
+}
+
+/* the send rate of |push|'s topic, or of the default topic */
+static struct bucket_t*
+pool_bucket(struct pool_t *pool, const struct push_t *push)
+{
+    const struct opt_t *opt = pool->opt;
+    const char *topic = push_topic(opt, push);
+    struct bucket_t *b;
+
+    for (b = pool->buckets; b; b = b->next) {
+        if (string_eq(b->topic, topic)) {
+            return b;
+        }
+    }
+    b = calloc(1, sizeof(*b));
+    if (b == NULL || (b->topic = alloc_string(topic)) == NULL) {
+        die("alloc bucket fail.");
+    }
+    /* -threads split the rate like they split -connections */
+    b->limit = opt->topic_rate / (opt->threads > 0 ? opt->threads : 1);
+    b->rate = b->limit;
+    b->tokens = 1;
+    b->last_us = monotonic_us();
+    b->next = pool->buckets;
+    pool->buckets = b;
+    return b;
+}
+
+static void
+pool_buckets_free(struct pool_t *pool)
+{
+    struct bucket_t *b;
+
+    while ((b = pool->buckets) != NULL) {
+        pool->buckets = b->next;
+        free(b->topic);
+        free(b);
+    }
+}
+
+/* microseconds until |b| lets the next request through, 0: now */
+static uint64_t
+bucket_wait_us(struct bucket_t *b, uint64_t now)
+{
+    double burst;
+
+    if (b->rate <= 0) {
+        return 0;
+    }
+    burst = b->rate * BUCKET_BURST_SECS < 1 ? 1 : b->rate * BUCKET_BURST_SECS;
+    b->tokens += (double)(now - b->last_us) * b->rate / 1e6;
+    if (b->tokens > burst) {
+        b->tokens = burst;
+    }
+    b->last_us = now;
+    if (b->tokens >= 1) {
+        return 0;
+    }
+    return (uint64_t)((1 - b->tokens) * 1e6 / b->rate) + 1;
+}
+
+static void
+bucket_take(struct bucket_t *b, uint64_t now)
+{
+    if (b->rate > 0) {
+        b->tokens -= 1;
+    }
+    if (now - b->window_us >= 1000000) {
+        b->last_sent = now - b->window_us < 2000000 ? b->window_sent : 0;
+        b->window_us = now;
+        b->window_sent = 0;
+    }
+    b->window_sent++;
+}
+
+/*
+ * APNs answered 429 for this topic. Every request in flight is likely
+ * to get one too, so the rate is halved once and then held for a
+ * while, the way TCP reacts to one loss per round trip.
+ */
+static void
+bucket_throttle(struct bucket_t *b, uint64_t now)
+{
+    double current = b->rate;
+
+    if (b->throttled_us && now - b->throttled_us < THROTTLE_HOLD_MS * 1000) {
+        return;
+    }
+    if (current <= 0) {
+        current = b->last_sent > b->window_sent ? b->last_sent : b->window_sent;
+        b->ceiling = current;
+    }
+    b->throttled_us = now;
+    b->rate = current / 2 < 1 ? 1 : current / 2;
+    b->tokens = 0;
+    b->last_us = now;
+    debug("[INFO] topic %s throttled to %.1f/s\n", b->topic, b->rate);
+}
+
+/* a request of the topic went through: creep back to the limit */
+static void
+bucket_ok(struct bucket_t *b)
+{
+    double cap;
+
+    if (b->throttled_us == 0) {
+        return;
+    }
+    cap = b->limit > 0 ? b->limit : b->ceiling;
+    b->rate += BUCKET_RECOVERY;
+    if (b->rate >= cap) {
+        b->rate = b->limit;
+        b->throttled_us = 0;
+    }
+}
+
+/*
+ * Whether the request on |st|, closed with |error_code|, is worth
+ * sending again: refused before the server processed it, or answered
+ * 429 (too many requests for the topic), 500 or 503 (trouble on the
+ * server side). Any other answer would only be repeated.
+ */
+static bool
+stream_retryable(const struct stream_t *st, uint32_t error_code)
+{
+    if (st->retries >= st->conn->pool->opt->retries) {
+        return false;
+    }
+    if (error_code == NGHTTP2_REFUSED_STREAM) {
+        return true;
+    }
+    return error_code == NGHTTP2_NO_ERROR &&
+           (st->status == 429 || st->status == 500 || st->status == 503);
+}
+
+/* queue |st| to be sent on the next free stream slot */
+static void
+pool_ready_push(struct pool_t *pool, struct stream_t *st)
+{
+    st->next = NULL;
+    if (pool->ready_tail) {
+        pool->ready_tail->next = st;
+    } else {
+        pool->ready = st;
+    }
+    pool->ready_tail = st;
+}
+
+/* the backoff is over, the stream queues for the next free slot */
+static void
+stream_retry_cb(struct loop_t *loop, struct loop_timer_t *timer)
+{
+    struct stream_t *st = timer->data;
+    struct pool_t *pool = st->conn->pool;
+
+    pool_ready_push(pool, st);
+    pool_dispatch(pool);
+    pool_check_done(pool);
+}
+
+/* take |st| off its connection and forget the answer it got there */
+static void
+stream_reset(struct stream_t *st)
+{
+    stream_detach(st);
+    st->stream_id = 0;
+    st->sent_pos = 0;
+    st->status = 0;
+    st->apns_id[0] = 0;
+    st->body.len = 0;
+    st->text.len = 0;
+    st->header_us = 0;
+}
+
+/*
+ * Take |st| off its connection and send it again after a backoff of
+ * RETRY_BASE_MS, doubled with every try; the second half of the delay
+ * is random so that requests throttled together do not all come back
+ * at the same time.
+ */
+static void
+stream_retry(struct stream_t *st)
+{
+    struct pool_t *pool = st->conn->pool;
+    uint64_t delay = (uint64_t)RETRY_BASE_MS << (st->retries < 16 ? st->retries : 16);
+
+    if (delay > RETRY_MAX_MS) {
+        delay = RETRY_MAX_MS;
+    }
+    delay = delay / 2 + pool_random(pool) % (delay / 2 + 1);
+    if (st->status == 429) {
+        bucket_throttle(st->bucket, monotonic_us());
+    }
+    debug("[INFO] retry %d of %s in %llu ms (status %d)\n", st->retries + 1, st->token,
+          (unsigned long long)delay, st->status);
+
+    stream_reset(st);
+    st->retries++;
+    pool->retrying++;
+    pool->batch->retried++;
+    loop_timer_start(pool->loop, &st->retry_timer, delay, stream_retry_cb, st);
+}
+
+/*
+ * |st| is on a connection going away, and the server has not processed
+ * it: refused by GOAWAY, never sent, or not completely written when the
+ * socket dropped. Queue it to go out again right away on another
+ * connection, without a backoff and without using up a retry. Returns
+ * false once it has moved MAX_MIGRATIONS times.
+ */
+static bool
+stream_migrate(struct stream_t *st)
+{
+    struct pool_t *pool = st->conn->pool;
+
+    if (st->migrations >= MAX_MIGRATIONS) {
+        return false;
+    }
+    debug("[INFO] moving stream %d (%s) off connection %d\n", st->stream_id, st->token,
+          st->conn->index);
+    stream_reset(st);
+    st->migrations++;
+    pool->retrying++;
+    pool->batch->migrated++;
+    pool_ready_push(pool, st);
+    return true;
+}
+
+static void
+pool_dispatch_cb(struct loop_t *loop, struct loop_timer_t *timer)
+{
+    pool_dispatch(timer->data);
+}
+
+/* hold back the next request of |b| if its rate says so */
+static bool
+pool_rate_ok(struct pool_t *pool, struct bucket_t *b)
+{
+    uint64_t wait = bucket_wait_us(b, monotonic_us());
+
+    if (wait == 0) {
+        return true;
+    }
+    loop_timer_start(pool->loop, &pool->rate_timer, (wait + 999) / 1000, pool_dispatch_cb, pool);
+    return false;
+}
+
+/*
+ * -bench request source. Requests go out as fast as streams free up
+ * or, with -rate, on a fixed schedule from g_bench.start_us: open loop,
+ * |due| is when the request should have been sent and latency counts
+ * from there, so a stalled client or server is not hidden by sending
+ * less (coordinated omission). Returns false when nothing is to be
+ * sent now; the timer brings the pool back when the next one is due.
+ */
+static bool
+bench_next_token(struct pool_t *pool, char *token, size_t size, uint64_t *due)
+{
+    struct batch_t *batch = pool->batch;
+    uint64_t now;
+
+    if (batch->bench_measured >= batch->bench_count) {
+        batch->eof = true;
+        return false;
+    }
+    if (batch->bench_concurrency && pool_inflight(pool) >= batch->bench_concurrency) {
+        return false;
+    }
+    now = monotonic_us();
+    *due = now;
+    if (batch->bench_rate > 0) {
+        *due = g_bench.start_us + (uint64_t)((double)batch->bench_sent * 1e6 / batch->bench_rate);
+        if (*due > now) {
+            loop_timer_start(pool->loop, &pool->bench_timer, (*due - now + 999) / 1000,
+                             pool_dispatch_cb, pool);
+            return false;
+        }
+    }
+    batch->bench_sent++;
+    if (*due >= g_bench.measure_us) {
+        if (batch->bench_measured++ == 0 && pool->worker <= 0) {
+            /* CPU time is per process, one pool takes the snapshot */
+            getrusage(RUSAGE_SELF, &g_bench.usage);
+        }
+    }
+    if (pool->opt->token) {
+        snprintf(token, size, "%s", pool->opt->token);
+    } else {
+        /* distinct per request and worker, the server never sees one twice */
+        snprintf(token, size, "%08x%056llx", (unsigned)(pool->worker + 1),
+                 (unsigned long long)batch->bench_sent);
+    }
+    return true;
+}
+
+/* send |st| on |conn|; a request that cannot even be submitted fails */
+static bool
+stream_submit(struct connection_t *conn, struct stream_t *st, const char *path,
+              size_t path_len)
+{
+    int32_t stream_id = submit_request(conn, conn->pool->opt, path, path_len, st);
+
+    if (stream_id < 0) {
+        fprintf(stderr, "submit request for %s fail: %s\n", st->token, nghttp2_strerror(stream_id));
+        conn->pool->batch->failed++;
+        stream_release(st, nghttp2_strerror(stream_id));
+        return false;
+    }
+    debug("[INFO] Stream ID = %d (connection %d)\n", stream_id, conn->index);
+    st->stream_id = stream_id;
+    bucket_take(st->bucket, monotonic_us());
+    conn->inflight++;
+    conn->dirty = true;
+    return true;
+}
+
+/*
+ * Hand out tokens from the batch to the least loaded connections until
+ * every stream slot is taken or a topic's send rate holds them back.
+ * Requests due for a retry go first. When the batch is exhausted and
+ * nothing is in flight or waiting for a retry any more, every session
+ * is terminated.
+ */
+static void
+pool_dispatch(struct pool_t *pool)
+{
+    struct batch_t *batch = pool->batch;
+    const struct opt_t *opt = pool->opt;
+    struct connection_t *conn;
+    struct stream_t *st;
+    struct fields_t fields;
+    char line[MAX_RECIPIENT_LEN];
+    char token[MAX_TOKEN_LEN];
+    char path[MAX_TOKEN_LEN + 64];
+    const char *text;
+    size_t text_len, path_len;
+    struct token_t bin;
+    uint64_t due = 0;
+    ssize_t n;
+    int i;
+
+    while (pool->ready || !batch->eof) {
+        struct push_t *push = NULL;
+        const char *payload = opt->payload;
+        size_t payload_len = opt->payload_len;
+        struct bucket_t *bucket;
+        struct tenant_t *tenant;
+
+        /* the certificate of the next request decides where it may go */
+        if ((st = pool->ready) != NULL) {
+            tenant = st->conn->tenant;
+        } else if (batch->daemon && batch->daemon->head) {
+            tenant = tenant_for_topic(push_topic(opt, batch->daemon->head));
+            if (tenant == NULL) {
+                batch->failed++;
+                daemon_reply(daemon_next_push(batch->daemon), NULL, "no certificate for topic");
+                continue;
+            }
+        } else {
+            tenant = g_tenants.dflt;
+        }
+        if ((conn = pool_pick(pool, tenant)) == NULL) {
+            if (pool_tenant_active(pool, tenant)) {
+                break;
+            }
+            /* not one slot of the tenant could be connected */
+            if (st) {
+                if ((pool->ready = st->next) == NULL) {
+                    pool->ready_tail = NULL;
+                }
+                pool->retrying--;
+                batch->failed++;
+                stream_finish(st, "no connection");
+                continue;
+            }
+            if (batch->daemon && batch->daemon->head) {
+                batch->failed++;
+                daemon_reply(daemon_next_push(batch->daemon), NULL, "no connection");
+                continue;
+            }
+            break;
+        }
+
+        if (st) {
+            if (!pool_rate_ok(pool, st->bucket)) {
+                break;
+            }
+            if ((pool->ready = st->next) == NULL) {
+                pool->ready_tail = NULL;
+            }
+            pool->retrying--;
+            stream_attach(conn, st);
+            path_len = (size_t)snprintf(path, sizeof(path), "%s%s", opt->prefix, st->token);
+            stream_submit(conn, st, path, path_len);
+            continue;
+        }
+
+        bucket = pool_bucket(pool, batch->daemon ? batch->daemon->head : NULL);
+        if (!pool_rate_ok(pool, bucket)) {
+            break;
+        }
+        if (opt->tpl) {
+            bzero(&fields, sizeof(fields));
+        }
+        if (opt->bench) {
+            if (!bench_next_token(pool, token, sizeof(token), &due)) {
+                break;
+            }
+            text = token;
+            text_len = strlen(token);
+        } else if (batch->daemon) {
+            if ((push = daemon_next_push(batch->daemon)) == NULL) {
+                break;
+            }
+            text = push->token;
+            text_len = strlen(push->token);
+            payload = push->payload;
+            payload_len = push->payload_len;
+        } else if (!batch_next_line(batch, &text, &text_len)) {
+            break;
+        } else if (opt->tpl && opt->tokens) {
+            /* the fields are picked out in place, from a copy */
+            bool ok = text_len < sizeof(line);
+            if (ok) {
+                memcpy(line, text, text_len);
+                line[text_len] = 0;
+                ok = template_fields(opt->tpl, line, &fields);
+            }
+            if (!ok) {
+                fprintf(stderr, "bad -tokens line skipped\n");
+                batch->failed++;
+                continue;
+            }
+            text = fields.token;
+            text_len = fields.token_len;
+        }
+        if (!token_parse(text, text_len, &bin)) {
+            batch_reject_token(batch, text, text_len);
+            if (push) {
+                daemon_reply(push, NULL, "invalid token");
+            }
+            continue;
+        }
+        if (push == NULL && batch_duplicate(batch, &bin)) {
+            continue;
+        }
+        if (dead_store_has(&bin)) {
+            batch->skipped++;
+            if (push) {
+                daemon_reply(push, NULL, "known invalid token");
+            }
+            continue;
+        }
+        token_format(&bin, token);
+        path_len = (size_t)snprintf(path, sizeof(path), "%s%s", opt->prefix, token);
+        st = stream_new(conn, token, payload, payload_len, push);
+        if (opt->bench) {
+            st->submit_us = due;
+            st->warmup = due < g_bench.measure_us;
+        }
+        if (opt->tpl && push == NULL) {
+            /* straight into the stream, nothing allocated per recipient */
+            if ((n = template_render(opt->tpl, &fields, st->rendered, MAX_PAYLOAD_LEN)) < 0) {
+                fprintf(stderr, "payload for %s exceeds %d bytes\n", token, MAX_PAYLOAD_LEN);
+                batch->failed++;
+                stream_release(st, "payload too large");
+                continue;
+            }
+            st->payload = st->rendered;
+            st->payload_len = (size_t)n;
+        }
+        st->bucket = bucket;
+        if (stream_submit(conn, st, path, path_len)) {
+            batch->submitted++;
+        }
+    }
+
+    if (batch->daemon) {
+        /* the requests of a tenant none of whose slots could be
+           connected were answered above: give its slots a fresh set
+           of tries for the next one */
+        for (i = 0; i < g_tenants.count; i++) {
+            struct connection_t *conns = pool_slots(pool, &g_tenants.list[i]);
+            int j;
+            if (pool_tenant_active(pool, &g_tenants.list[i])) {
+                continue;
+            }
+            for (j = 0; j < 2 * pool->target; j++) {
+                conns[j].reconnect_tries = 0;
+            }
+        }
+    }
+    if (pool->retiring) {
+        pool_retire_stale(pool);
+    }
+
+    if (batch->eof && pool_inflight(pool) == 0 && pool->retrying == 0) {
+        for (i = 0; i < pool->size; i++) {
+            conn = &pool->conns[i];
+            if (conn->connecting) {
+                /* nothing left for it to send */
+                connection_cleanup(conn);
+                continue;
+            }
+            if (conn->session == NULL || conn->closing) {
+                continue;
+            }
+            connection_terminate(conn);
+        }
+    }
+}
+
+/*
+ * pthread_create() for threads that never run the event loop (the output
+ * and resolver threads): they start with every signal blocked, so SIGHUP,
+ * SIGINT and SIGTERM stay pending for the loop thread's signalfd instead
+ * of taking their default action on a helper.
+ */
+static int
+helper_thread_create(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t all, old;
+    int rv;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rv = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return rv;
+}
+
+static uint64_t
+monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static uint64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void
+loop_init(struct loop_t *loop)
+{
+    bzero(loop, sizeof(*loop));
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        diec("epoll_create1", errno);
+    }
+    loop->now = monotonic_ms();
+    loop->tick = loop->now;
+}
+
+static void
+loop_destroy(struct loop_t *loop)
+{
+    if (loop->epfd >= 0) {
+        close(loop->epfd);
+        loop->epfd = -1;
+    }
+}
+
+static bool
+loop_io_add(struct loop_t *loop, struct loop_io_t *io, int fd, uint32_t events,
+            loop_io_cb cb, void *data)
+{
+    struct epoll_event ev;
+    io->fd = fd;
+    io->events = events | EPOLLET;
+    io->cb = cb;
+    io->data = data;
+    ev.events = io->events;
+    ev.data.ptr = io;
+    return 0 == epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* only touches epoll when the interest set actually changes */
+static void
+loop_io_mod(struct loop_t *loop, struct loop_io_t *io, uint32_t events)
+{
+    struct epoll_event ev;
+    events |= EPOLLET;
+    if (io->events == events) {
+        return;
+    }
+    io->events = events;
+    ev.events = events;
+    ev.data.ptr = io;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, io->fd, &ev) != 0) {
+        diec("epoll_ctl", errno);
+    }
+}
+
+static void
+loop_io_del(struct loop_t *loop, struct loop_io_t *io)
+{
+    if (io->fd >= 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, io->fd, NULL);
+        io->fd = -1;
+    }
+}
+
+static void
+loop_timer_stop(struct loop_t *loop, struct loop_timer_t *timer)
+{
+    if (!timer->active) {
+        return;
+    }
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->head = timer->next;
+    }
+    if (timer->next) {
+        timer->next->prev = timer->prev;
+    }
+    if (*timer->head == NULL && timer->head != &loop->running) {
+        size_t slot = (size_t)(timer->head - loop->wheel[0]);
+        loop->occupied[slot / WHEEL_SLOTS] &= ~(1ULL << (slot % WHEEL_SLOTS));
+    }
+    timer->prev = timer->next = NULL;
+    timer->head = NULL;
+    timer->active = false;
+    loop->ntimers--;
+}
+
+/* put |timer| in the slot for its due time, as seen from loop->tick */
+static void
+loop_timer_place(struct loop_t *loop, struct loop_timer_t *timer)
+{
+    uint64_t due = timer->due < loop->tick ? loop->tick : timer->due;
+    uint64_t delta = due - loop->tick;
+    int level = 0;
+    size_t slot;
+
+    while (level < WHEEL_LEVELS - 1 && delta >> ((level + 1) * WHEEL_BITS)) {
+        level++;
+    }
+    if (delta >> (WHEEL_LEVELS * WHEEL_BITS)) {
+        /* beyond the wheel: wait in the last slot it reaches */
+        due = loop->tick + (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+    }
+    slot = (size_t)(due >> (level * WHEEL_BITS)) & WHEEL_MASK;
+    timer->head = &loop->wheel[level][slot];
+    timer->prev = NULL;
+    timer->next = *timer->head;
+    if (timer->next) {
+        timer->next->prev = timer;
+    }
+    *timer->head = timer;
+    timer->active = true;
+    loop->occupied[level] |= 1ULL << slot;
+    loop->ntimers++;
+}
+
+static void
+loop_timer_start(struct loop_t *loop, struct loop_timer_t *timer, uint64_t after_ms,
+                 loop_timer_cb cb, void *data)
+{
+    loop_timer_stop(loop, timer);
+    if (loop->ntimers == 0 && loop->tick < loop->now) {
+        /* nothing is waiting, the wheel can jump to now */
+        loop->tick = loop->now;
+    }
+    timer->due = loop->now + after_ms;
+    timer->cb = cb;
+    timer->data = data;
+    loop_timer_place(loop, timer);
+}
+
+/*
+ * When the wheel must be turned next: the next level 0 slot with
+ * timers in it, or the next slot of a higher level to be moved down.
+ * Once the wheel is past the start of a block, the slot of that block
+ * on a higher level is only reached on its next turn. UINT64_MAX when
+ * no timer is set.
+ */
+static uint64_t
+loop_timer_next(const struct loop_t *loop)
+{
+    uint64_t next = UINT64_MAX, t, bits;
+    unsigned first, cur;
+    int level, shift;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (loop->occupied[level] == 0) {
+            continue;
+        }
+        shift = level * WHEEL_BITS;
+        cur = (unsigned)(loop->tick >> shift) & WHEEL_MASK;
+        first = level == 0 || (loop->tick & ((1ULL << shift) - 1)) == 0 ? cur : cur + 1;
+        bits = first < WHEEL_SLOTS ? loop->occupied[level] >> first : 0;
+        if (bits) {
+            t = ((loop->tick >> shift) + (first - cur) + (unsigned)__builtin_ctzll(bits)) << shift;
+        } else {
+            /* only slots of the next turn are taken */
+            t = ((loop->tick >> (shift + WHEEL_BITS)) + 1) << (shift + WHEEL_BITS);
+        }
+        if (t < next) {
+            next = t;
+        }
+    }
+    return next;
+}
+
+/* run every timer due by loop->now */
+static void
+loop_timers_run(struct loop_t *loop)
+{
+    struct loop_timer_t *t, **slot;
+    uint64_t tick;
+    int level;
+
+    while ((tick = loop_timer_next(loop)) <= loop->now) {
+        loop->tick = tick;
+        /* at the start of a block, its slot one level up moves down */
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (tick & ((1ULL << (level * WHEEL_BITS)) - 1)) {
+                break;
+            }
+            slot = &loop->wheel[level][(tick >> (level * WHEEL_BITS)) & WHEEL_MASK];
+            while ((t = *slot) != NULL) {
+                loop_timer_stop(loop, t);
+                loop_timer_place(loop, t);
+            }
+        }
+
+        /* timers started by the callbacks go to later slots */
+        loop->tick = tick + 1;
+        slot = &loop->wheel[0][tick & WHEEL_MASK];
+        loop->running = *slot;
+        for (t = loop->running; t; t = t->next) {
+            t->head = &loop->running;
+        }
+        *slot = NULL;
+        loop->occupied[0] &= ~(1ULL << (tick & WHEEL_MASK));
+        while ((t = loop->running) != NULL) {
+            loop_timer_stop(loop, t);
+            t->cb(loop, t);
+        }
+    }
+}
+
+static void
+loop_stop(struct loop_t *loop)
+{
+    loop->stop = true;
+}
+
+/* one round: the prepare hook, a wait for I/O or the next timer, callbacks */
+static void
+loop_run_once(struct loop_t *loop)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    uint64_t next;
+    int i, n, timeout;
+
+    if (loop->prepare) {
+        loop->prepare(loop, loop->prepare_data);
+        if (loop->stop) {
+            return;
+        }
+    }
+
+    timeout = -1;
+    if ((next = loop_timer_next(loop)) != UINT64_MAX) {
+        loop->now = monotonic_ms();
+        timeout = next <= loop->now ? 0 :
+                  next - loop->now > INT_MAX ? INT_MAX : (int)(next - loop->now);
+    }
+    n = epoll_wait(loop->epfd, events, MAX_EPOLL_EVENTS, timeout);
+    if (n == -1) {
+        if (errno != EINTR) {
+            diec("epoll_wait", errno);
+        }
+        n = 0;
+    }
+    loop->now = monotonic_ms();
+    for (i = 0; i < n; i++) {
+        struct loop_io_t *io = events[i].data.ptr;
+        io->cb(loop, io, events[i].events);
+    }
+    loop_timers_run(loop);
+}
+
+static void
+loop_run(struct loop_t *loop)
+{
+    while (!loop->stop) {
+        loop_run_once(loop);
+    }
+}
+
+/*
+ * nghttp2 has run out of frames to write on |conn|. The staged output
+ * goes out now, or with -flush-delay when the timer fires, so frames
+ * submitted in the meantime share the record.
+ */
+static bool
+connection_send_done(struct connection_t *conn)
+{
+  int delay = conn->pool->opt->flush_delay;
+
+  if (conn->outlen == 0 || conn->out_blocked || delay <= 0) {
+    return connection_flush(conn);
+  }
+  if (!conn->flush_timer.active) {
+    loop_timer_start(conn->pool->loop, &conn->flush_timer, (uint64_t)delay,
+                     connection_flush_cb, conn);
+  }
+  return true;
+}
+
+/*
+ * nghttp2_session_send(), timed with -stats so that the encoding cost
+ * per request can be told apart from the cost of the TLS writes.
+ */
+static int session_send(struct connection_t *conn) {
+  struct pool_stats_t *stats = &conn->pool->stats;
+  uint64_t start_ns, write_ns;
+  int rv;
+
+  if (!conn->pool->opt->stats) {
+    return nghttp2_session_send(conn->session);
+  }
+  start_ns = monotonic_ns();
+  write_ns = stats->write_ns;
+  rv = nghttp2_session_send(conn->session);
+  stats->encode_ns += monotonic_ns() - start_ns - (stats->write_ns - write_ns);
+  return rv;
+}
+
+static bool exec_io(struct connection_t *connection) {
+  int rv;
+  rv = nghttp2_session_recv(connection->session);
+  if (rv != 0) {
+    fprintf(stderr, "nghttp2_session_recv: %s\n", nghttp2_strerror(rv));
+    return false;
+  }
+  rv = session_send(connection);
+  if (rv != 0) {
+    fprintf(stderr, "nghttp2_session_send: %s\n", nghttp2_strerror(rv));
+    return false;
+  }
+  return connection_send_done(connection);
+}
+
+/*
+ * Readiness is edge triggered, so reading stays armed and nghttp2
+ * drains the socket on every wakeup. Writes are attempted directly
+ * from the prepare hook; EPOLLOUT is only needed while SSL_write is
+ * blocked on a full socket buffer.
+ */
+static void ctl_epoll(struct loop_t *loop, struct connection_t *connection) {
+  uint32_t events = 0;
+  if (nghttp2_session_want_read(connection->session) ||
+      connection->want_io == WANT_READ) {
+    events |= EPOLLIN;
+  }
+  if (connection->want_io == WANT_WRITE) {
+    events |= EPOLLOUT;
+  }
+  loop_io_mod(loop, &connection->io, events);
+}
+
+static bool
+connection_active(struct connection_t *conn)
+{
+  return conn->session &&
+         (nghttp2_session_want_read(conn->session) ||
+          nghttp2_session_want_write(conn->session) ||
+          conn->outlen > 0);
+}
+
+/*
+ * A batch run is over once no connection is left. A daemon keeps its
+ * slots for later requests and only stops once it has drained.
+ */
+static void
+pool_check_done(struct pool_t *pool)
+{
+  if (!pool_active(pool) && pool->retrying == 0 &&
+      (pool->batch->daemon == NULL || pool->batch->eof)) {
+    loop_stop(pool->loop);
+  }
+}
+
+/*
+ * Called after any I/O on |conn|. A finished session (GOAWAY exchanged
+ * and all streams closed) is torn down; otherwise the epoll interest
+ * set is brought in line with what the session wants next.
+ */
+static void
+connection_update(struct connection_t *conn)
+{
+  struct pool_t *pool = conn->pool;
+
+  if (connection_active(conn)) {
+    ctl_epoll(pool->loop, conn);
+    return;
+  }
+  connection_cleanup(conn);
+  pool_dispatch(pool);
+  pool_check_done(pool);
+}
+
+/*
+ * Whether the server may have processed |st|: all of the request was
+ * written to the socket and, if GOAWAY came, it is not above the last
+ * stream id the server announced.
+ */
+static bool
+stream_delivered(const struct stream_t *st)
+{
+  const struct connection_t *conn = st->conn;
+
+  if (conn->goaway && st->stream_id > conn->goaway_last_id) {
+    return false;
+  }
+  return st->sent_pos != 0 && st->sent_pos <= conn->written;
+}
+
+/*
+ * A connection went away under us. Streams in flight on it that the
+ * server never got move to another connection; those it may have
+ * processed are counted as failed rather than sent twice. The slot is
+ * left for pool_pick() to reconnect.
+ */
+static void
+connection_lost(struct connection_t *conn)
+{
+  struct pool_t *pool = conn->pool;
+  struct stream_t *st;
+  uint32_t migrated = 0;
+
+  while ((st = conn->streams) != NULL) {
+    if (!stream_delivered(st) && stream_migrate(st)) {
+      migrated++;
+      continue;
+    }
+    pool->batch->failed++;
+    stream_release(st, "connection lost");
+  }
+  fprintf(stderr, "connection %d lost, %u streams in flight, %u moved\n", conn->index,
+          conn->inflight, migrated);
+  conn->inflight = 0;
+  connection_cleanup(conn);
+  pool_dispatch(pool);
+  pool_check_done(pool);
+}
+
+/* the -flush-delay deadline for staged output passed */
+static void
+connection_flush_cb(struct loop_t *loop, struct loop_timer_t *timer)
+{
+  struct connection_t *conn = timer->data;
+
+  if (!connection_flush(conn)) {
+    connection_lost(conn);
+    return;
+  }
+  connection_update(conn);
+}
+
+/*
+ * Nothing was read from |conn| for -timeout seconds. That is only an
+ * error while we are waiting on the server for something.
+ */
+static void
+connection_timeout_cb(struct loop_t *loop, struct loop_timer_t *timer)
+{
+  struct connection_t *conn = timer->data;
+
+  if (conn->inflight == 0 && conn->settings_received) {
+    loop_timer_start(loop, timer, (uint64_t)conn->pool->opt->timeout * 1000,
+                     connection_timeout_cb, conn);
+    return;
+  }
+  fprintf(stderr, "connection %d timed out\n", conn->index);
+  connection_lost(conn);
+}
+
+/*
+ * -ping timer. With no PING outstanding, time to send one; its answer
+ * measures the round trip and also keeps middleboxes from dropping an
+ * idle connection. Otherwise the PING went unanswered for
+ * PING_TIMEOUT_MS and the connection is replaced before a request
+ * runs into it.
+ */
+static void
+connection_ping_cb(struct loop_t *loop, struct loop_timer_t *timer)
+{
+  struct connection_t *conn = timer->data;
+  struct pool_t *pool = conn->pool;
+  uint8_t opaque[8];
+  int rv;
+
+  if (conn->ping_sent_us) {
+    fprintf(stderr, "connection %d: PING unanswered for %d ms\n", conn->index, PING_TIMEOUT_MS);
+    connection_lost(conn);
+    pool_refill(pool, conn->tenant);
+    return;
+  }
+  conn->ping_sent_us = monotonic_us();
+  memcpy(opaque, &conn->ping_sent_us, sizeof(opaque));
+  rv = nghttp2_submit_ping(conn->session, NGHTTP2_FLAG_NONE, opaque);
+  if (rv != 0) {
+    fprintf(stderr, "nghttp2_submit_ping: %s\n", nghttp2_strerror(rv));
+    connection_lost(conn);
+    return;
+  }
+  conn->dirty = true;
+  loop_timer_start(loop, timer, PING_TIMEOUT_MS, connection_ping_cb, conn);
+}
+
+/* our PING came back: one round trip sample, and the next PING due */
+static void
+connection_ping_ack(struct connection_t *conn, const uint8_t *opaque)
+{
+  uint64_t sent_us, rtt;
+
+  memcpy(&sent_us, opaque, sizeof(sent_us));
+  if (conn->ping_sent_us == 0 || sent_us != conn->ping_sent_us) {
+    return;
+  }
+  rtt = monotonic_us() - sent_us;
+  /* smoothed like TCP's SRTT, 1/8 of each new sample */
+  conn->rtt_us = conn->rtt_us ? (7 * conn->rtt_us + rtt) / 8 : rtt;
+  conn->ping_sent_us = 0;
+  hist_record(&conn->pool->stats.hist[PHASE_PING], rtt);
+  debug("[INFO] connection %d: PING rtt %llu us, smoothed %llu us\n", conn->index,
+        (unsigned long long)rtt, (unsigned long long)conn->rtt_us);
+  loop_timer_start(conn->pool->loop, &conn->ping_timer,
+                   (uint64_t)conn->pool->opt->ping * 1000, connection_ping_cb, conn);
+}
+
+static void
+connection_arm_timeout(struct connection_t *conn)
+{
+  int timeout = conn->pool->opt->timeout;
+  if (timeout > 0) {
+    loop_timer_start(conn->pool->loop, &conn->timer, (uint64_t)timeout * 1000,
+                     connection_timeout_cb, conn);
+  }
+}
+
+static void
+connection_io_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events)
+{
+  struct connection_t *conn = io->data;
+
+  if (conn->session == NULL) {
+    return;
+  }
+  connection_arm_timeout(conn);
+  conn->dirty = false;
+  if (!exec_io(conn)) {
+    connection_lost(conn);
+    return;
+  }
+  if (events & EPOLLERR) {
+    connection_lost(conn);
+    return;
+  }
+  connection_update(conn);
+}
+
+/*
+ * Prepare hook: push out what callbacks submitted on connections other
+ * than the one being serviced, e.g. streams refilled from another
+ * connection's stream close.
+ */
+static void
+pool_flush(struct loop_t *loop, void *data)
+{
+  struct pool_t *pool = data;
+  int i, rv;
+
+  for (i = 0; i < pool->size; i++) {
+    struct connection_t *conn = &pool->conns[i];
+    if (!conn->dirty || conn->session == NULL) {
+      continue;
+    }
+    conn->dirty = false;
+    rv = session_send(conn);
+    if (rv != 0) {
+      fprintf(stderr, "nghttp2_session_send: %s\n", nghttp2_strerror(rv));
+      connection_lost(conn);
+      continue;
+    }
+    if (!connection_send_done(conn)) {
+      connection_lost(conn);
+      continue;
+    }
+    connection_update(conn);
+  }
+  /* results of this round go to the output thread in one piece */
+  writer_flush(&pool->out);
+}
+
+static void
+pool_auth_cb(struct loop_t *loop, struct loop_timer_t *timer)
+{
+    jwt_refresh(&g_jwt);
+    loop_timer_start(loop, timer, JWT_CHECK_MS, pool_auth_cb, timer->data);
+}
+
+static const char *phase_names[PHASE_MAX] = {
+    "dns", "connect", "tls", "settings", "ping", "first header", "total"
+};
+
+static void
+pool_stats_add(struct pool_stats_t *dst, const struct pool_stats_t *src)
+{
+    int i;
+    dst->reconnects += src->reconnects;
+    dst->ssl_writes += src->ssl_writes;
+    dst->records += src->records;
+    dst->bytes_out += src->bytes_out;
+    dst->completed += src->completed;
+    dst->headers += src->headers;
+    dst->header_bytes += src->header_bytes;
+    dst->encode_ns += src->encode_ns;
+    dst->write_ns += src->write_ns;
+    for (i = 0; i < PHASE_MAX; i++) {
+        hist_add(&dst->hist[i], &src->hist[i]);
+    }
+}
+
+/*
+ * Print the latency percentiles of |stats| and the throughput over
+ * |secs| to stderr, in one piece so reports of several workers do not
+ * interleave.
+ */
+static void
+stats_report(const char *title, const struct pool_stats_t *stats, double secs)
+{
+    static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+    struct buf_t b = { NULL, 0, 0 };
+    char line[256];
+    size_t i, k;
+    int n;
+
+    snprintf(line, sizeof(line), "stats: %s: %llu completed in %.3f s, %.1f/s\n"
+             "  %-12s %10s %10s %10s %10s %10s %10s (ms)\n",
+             title, (unsigned long long)stats->completed, secs,
+             secs > 0 ? (double)stats->completed / secs : 0.0,
+             "phase", "count", "p50", "p90", "p99", "p99.9", "max");
+    buf_puts(&b, line);
+    for (i = 0; i < PHASE_MAX; i++) {
+        const struct hist_t *h = &stats->hist[i];
+        if (h->count == 0) {
+            continue;
+        }
+        n = snprintf(line, sizeof(line), "  %-12s %10llu", phase_names[i],
+                     (unsigned long long)h->count);
+        for (k = 0; k < sizeof(q) / sizeof(q[0]); k++) {
+            n += snprintf(line + n, sizeof(line) - (size_t)n, " %10.3f",
+                          (double)hist_percentile(h, q[k]) / 1000.0);
+        }
+        snprintf(line + n, sizeof(line) - (size_t)n, " %10.3f\n", (double)h->max / 1000.0);
+        buf_puts(&b, line);
+    }
+    if (stats->headers) {
+        snprintf(line, sizeof(line), "  headers: %llu frames, %.1f bytes and %.3f us encoding per request\n",
+                 (unsigned long long)stats->headers,
+                 (double)stats->header_bytes / (double)stats->headers,
+                 (double)stats->encode_ns / (double)stats->headers / 1000.0);
+        buf_puts(&b, line);
+    }
+    if (b.data) {
+        pthread_mutex_lock(&g_output_lock);
+        fwrite(b.data, 1, b.len, stderr);
+        pthread_mutex_unlock(&g_output_lock);
+    }
+    buf_free(&b);
+}
+
+/* -stats-interval: report what happened on this pool since the last report */
+static void
+pool_stats_cb(struct loop_t *loop, struct loop_timer_t *timer)
+{
+    struct pool_t *pool = timer->data;
+    struct pool_stats_t delta;
+    char title[64];
+    int i;
+
+    bzero(&delta, sizeof(delta));
+    delta.completed = pool->stats.completed - pool->last.completed;
+    delta.headers = pool->stats.headers - pool->last.headers;
+    delta.header_bytes = pool->stats.header_bytes - pool->last.header_bytes;
+    delta.encode_ns = pool->stats.encode_ns - pool->last.encode_ns;
+    delta.write_ns = pool->stats.write_ns - pool->last.write_ns;
+    for (i = 0; i < PHASE_MAX; i++) {
+        hist_since(&delta.hist[i], &pool->stats.hist[i], &pool->last.hist[i]);
+    }
+    pool->last = pool->stats;
+    if (pool->worker >= 0) {
+        snprintf(title, sizeof(title), "worker %d, last %d s", pool->worker,
+                 pool->opt->stats_interval);
+    } else {
+        snprintf(title, sizeof(title), "last %d s", pool->opt->stats_interval);
+    }
+    stats_report(title, &delta, (double)pool->opt->stats_interval);
+    loop_timer_start(loop, timer, (uint64_t)pool->opt->stats_interval * 1000,
+                     pool_stats_cb, pool);
+}
+
+static bool
+blocking_post(struct loop_t *loop, struct pool_t *pool)
+{
+    pool->running = true;
+    pool_dispatch(pool);
+    if (pool->batch->eof && pool->batch->submitted == 0 && pool->batch->worker == NULL) {
+	fprintf(stderr, "no request submitted\n");
+	return false;
+    }
+
+    /* maybe running in a thread */
+    loop->prepare = pool_flush;
+    loop->prepare_data = pool;
+    if (pool->opt->p8) {
+        loop_timer_start(loop, &pool->auth_timer, JWT_CHECK_MS, pool_auth_cb, pool);
+    }
+    if (pool->opt->stats_interval > 0) {
+        loop_timer_start(loop, &pool->stats_timer, (uint64_t)pool->opt->stats_interval * 1000,
+                         pool_stats_cb, pool);
+    }
+    loop_run(loop);
+    loop_timer_stop(loop, &pool->auth_timer);
+    loop_timer_stop(loop, &pool->stats_timer);
+    loop_timer_stop(loop, &pool->bench_timer);
+    loop_timer_stop(loop, &pool->rate_timer);
+    writer_flush(&pool->out);
+
+    if (!pool->batch->eof) {
+        /* main reports it once every result collected is written */
+        pool->batch->stranded = true;
+        return false;
+    }
+    debug("over.\n");
+    return true;
+}
+
+/* close the sockets of |d| still connecting, stop its timer and lookup */
+static void
+dialer_close(struct dialer_t *d, struct loop_t *loop)
+{
+    int i, fd;
+
+    for (i = 0; i < MAX_RESOLVED_ADDRS; i++) {
+        struct loop_io_t *io = &d->attempts[i].io;
+        if ((fd = io->fd) >= 0) {
+            loop_io_del(loop, io);
+            close(fd);
+        }
+    }
+    d->pending = 0;
+    loop_timer_stop(loop, &d->attempt_timer);
+    if (d->wait_io.fd >= 0) {
+        loop_io_del(loop, &d->wait_io);
+        resolve_cancel(&d->wait);
+    }
+}
+
+static void
+dialer_free(struct dialer_t *d)
+{
+    if (d) {
+        close(d->wait.fd);
+        free(d);
+    }
+}
+
+static void
+connection_cleanup(struct connection_t *conn)
+{
+  if (conn->pool) {
+    loop_io_del(conn->pool->loop, &conn->io);
+    loop_timer_stop(conn->pool->loop, &conn->timer);
+    loop_timer_stop(conn->pool->loop, &conn->flush_timer);
+    loop_timer_stop(conn->pool->loop, &conn->ping_timer);
+    if (conn->dialer) {
+      dialer_close(conn->dialer, conn->pool->loop);
+    }
+  }
+  conn->connecting = false;
+  conn->dirty = false;
+  conn->outlen = 0;
+  conn->out_blocked = false;
+  while (conn->streams) {
+    stream_release(conn->streams, "connection closed");
+  }
+  if (conn->session) {
+    nghttp2_session_del(conn->session);
+    conn->session = NULL;
+  }
+  if (conn->ssl) {
+    SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+  }
+  if (conn->fd >= 0) {
+    shutdown(conn->fd, SHUT_WR);
+    close(conn->fd);
+    conn->fd = -1;
+  }
+}
+
+/*
+ * Setting up |conn| failed. The slot is left clean for pool_pick() to
+ * try again, up to MAX_RECONNECT_TRIES times; requests waiting for it
+ * go elsewhere or fail.
+ */
+static void
+connection_start_failed(struct connection_t *conn)
+{
+    struct pool_t *pool = conn->pool;
+
+    connection_cleanup(conn);
+    conn->reconnect_tries++;
+    if (pool->running) {
+        pool_dispatch(pool);
+        pool_check_done(pool);
+    }
+}
 
-  }
-  return 0;
+/* TLS is up: the HTTP/2 session takes over the socket */
+static void
+connection_established(struct connection_t *conn)
+{
+    struct pool_t *pool = conn->pool;
+    const struct opt_t *opt = pool->opt;
+
+    ssl_handshake_done(conn);
+    hist_record(&pool->stats.hist[PHASE_TLS], monotonic_us() - conn->open_us);
+    conn->open_us = monotonic_us();
+    conn->connecting = false;
+    conn->want_io = IO_NONE;
+    set_nghttp2_session_info(conn);
+    set_tcp_nodelay(conn->fd);
+    conn->io.cb = connection_io_cb;
+    loop_io_mod(pool->loop, &conn->io, EPOLLIN | EPOLLOUT);
+    /* the client preface and SETTINGS go out from the prepare hook */
+    conn->dirty = true;
+    loop_timer_stop(pool->loop, &conn->timer);
+    connection_arm_timeout(conn);
+    if (opt->ping > 0) {
+        loop_timer_start(pool->loop, &conn->ping_timer, (uint64_t)opt->ping * 1000,
+                         connection_ping_cb, conn);
+    }
+    conn->reconnect_tries = 0;
+    if (pool->running) {
+        pool_dispatch(pool);
+    }
 }
 
-static int on_begin_headers_callback(nghttp2_session *session,
-                                                 const nghttp2_frame *frame,
-                                                 void *user_data) {
-  printf("\n");
-  debug("[INFO] C <---------------------------- S (HEADERS begin)\n");
-  return 0;
+/* take the handshake of |conn| as far as the socket allows */
+static void
+connection_handshake(struct connection_t *conn)
+{
+    int rv = ssl_handshake(conn);
+
+    if (rv < 0) {
+        fprintf(stderr, "ssl handshake error\n");
+        connection_start_failed(conn);
+    } else if (rv == 0) {
+        loop_io_mod(conn->pool->loop, &conn->io, conn->want_io == WANT_WRITE ? EPOLLOUT : EPOLLIN);
+    } else {
+        connection_established(conn);
+    }
+}
+
+static void
+connection_handshake_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events)
+{
+    struct connection_t *conn = io->data;
+
+    if (conn->connecting && conn->ssl) {
+        connection_handshake(conn);
+    }
+}
+
+/* the connect or TLS handshake took longer than -timeout */
+static void
+connection_start_timeout_cb(struct loop_t *loop, struct loop_timer_t *timer)
+{
+    struct connection_t *conn = timer->data;
+    const char *what = conn->ssl ? "tls handshake to" :
+                       conn->dialer->wait_io.fd >= 0 ? "lookup of" : "connect to";
+
+    fprintf(stderr, "connection %d: %s %s:%d timed out\n", conn->index,
+            what, conn->pool->opt->uri, conn->pool->opt->port);
+    connection_start_failed(conn);
 }
 
+static void
+dialer_io_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events);
+
 /*
- * The implementation of nghttp2_on_stream_close_callback type. We use
- * this function to know the response is fully received. Since we just
- * fetch 1 resource in this program, after reception of the response,
- * we submit GOAWAY and close the session.
+ * Start a non-blocking connect to the next address of |d| that takes
+ * one. Returns false once the addresses are used up.
  */
-static int on_stream_close_callback(nghttp2_session *session, int32_t stream_id,
-                                    uint32_t error_code _U_,
-                                    void *user_data _U_) {
-  struct connection_t *conn = nghttp2_session_get_stream_user_data(session, stream_id);
-  if (conn) {
+static bool
+dialer_next(struct dialer_t *d)
+{
+    const struct opt_t *opt = d->conn->pool->opt;
+    char name[INET6_ADDRSTRLEN + 16];
+    int fd, rv;
+
+    while (d->next < d->naddrs) {
+        const struct endpoint_t *a = &d->addrs[d->next];
+        struct dial_attempt_t *at = &d->attempts[d->next++];
+
+        debug("connecting to : %s\n", endpoint_str(a, name, sizeof(name)));
+        fd = socket(a->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            continue;
+        }
+        while ((rv = connect(fd, (const struct sockaddr *)&a->addr, a->addrlen)) == -1 &&
+               errno == EINTR)
+            ;
+        if (rv == 0 || errno == EINPROGRESS) {
+            /* writable once connected or failed */
+            if (loop_io_add(d->conn->pool->loop, &at->io, fd, EPOLLOUT, dialer_io_cb, at)) {
+                d->pending++;
+                return true;
+            }
+            at->io.fd = -1;
+        }
+        debug("connect %s: %s\n", name, strerror(errno));
+        resolve_mark_failed(opt->uri, opt->port, a);
+        close(fd);
+    }
+    return false;
+}
+
+static void
+dialer_attempt_cb(struct loop_t *loop, struct loop_timer_t *timer);
+
+/*
+ * Happy eyeballs (RFC 8305): a connect to the next address starts
+ * every CONNECT_ATTEMPT_DELAY_MS, or as soon as the previous ones
+ * failed, and the first to complete wins. A dead address thus costs at
+ * most the attempt delay instead of a whole TCP timeout, and nothing
+ * waits for it but this connection.
+ */
+static void
+dialer_advance(struct dialer_t *d)
+{
+    struct connection_t *conn = d->conn;
+    struct loop_t *loop = conn->pool->loop;
+
+    dialer_next(d);
+    if (d->pending == 0) {
+        fprintf(stderr, "socket connect fail: %s:%d\n", conn->pool->opt->uri, conn->pool->opt->port);
+        connection_start_failed(conn);
+        return;
+    }
+    if (d->next < d->naddrs) {
+        loop_timer_start(loop, &d->attempt_timer, CONNECT_ATTEMPT_DELAY_MS,
+                         dialer_attempt_cb, d);
+    }
+}
+
+static void
+dialer_attempt_cb(struct loop_t *loop, struct loop_timer_t *timer)
+{
+    dialer_advance(timer->data);
+}
+
+/* one of the sockets of |at|'s dialer connected or failed */
+static void
+dialer_io_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events)
+{
+    struct dial_attempt_t *at = io->data;
+    struct dialer_t *d = at->dialer;
+    struct connection_t *conn = d->conn;
+    const struct opt_t *opt = conn->pool->opt;
+    const struct endpoint_t *a = &d->addrs[at - d->attempts];
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(int);
+    char name[INET6_ADDRSTRLEN + 16];
+    int fd = io->fd, err = 0;
+
+    /* closed already, by a winner or a failure earlier in this round */
+    if (fd < 0) {
+        return;
+    }
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err == 0) {
+        len = sizeof(peer);
+        if (getpeername(fd, (struct sockaddr *)&peer, &len) != 0) {
+            /* an event left from an earlier socket: still connecting */
+            return;
+        }
+    }
+    loop_io_del(loop, io);
+    d->pending--;
+    if (err != 0) {
+        debug("connect %s: %s\n", endpoint_str(a, name, sizeof(name)), strerror(err));
+        resolve_mark_failed(opt->uri, opt->port, a);
+        close(fd);
+        if (d->pending == 0) {
+            dialer_advance(d);
+        }
+        return;
+    }
+
+    /* the first to connect wins, the others are dropped */
+    dialer_close(d, loop);
+    hist_record(&conn->pool->stats.hist[PHASE_CONNECT], monotonic_us() - d->start_us);
+    debug("connected to : %s\n", endpoint_str(a, name, sizeof(name)));
+    conn->fd = fd;
+    conn->open_us = monotonic_us();
+    if (!ssl_allocate(conn) || SSL_set_fd(conn->ssl, fd) == 0) {
+        fprintf(stderr, "ssl allocation error\n");
+        connection_start_failed(conn);
+        return;
+    }
+    SSL_set_connect_state(conn->ssl);
+    debug("ssl handshaking ...\n");
+    if (!loop_io_add(loop, &conn->io, fd, EPOLLIN, connection_handshake_cb, conn)) {
+        connection_start_failed(conn);
+        return;
+    }
+    connection_handshake(conn);
+}
+
+/* the addresses of |d| are known: start the race over them */
+static bool
+dialer_start(struct dialer_t *d)
+{
+    struct pool_t *pool = d->conn->pool;
+    const struct opt_t *opt = pool->opt;
+
+    hist_record(&pool->stats.hist[PHASE_DNS], monotonic_us() - d->start_us);
+    d->start_us = monotonic_us();
+    if (!dialer_next(d)) {
+        fprintf(stderr, "socket connect fail: %s:%d\n", opt->uri, opt->port);
+        return false;
+    }
+    if (d->next < d->naddrs) {
+        loop_timer_start(pool->loop, &d->attempt_timer, CONNECT_ATTEMPT_DELAY_MS,
+                         dialer_attempt_cb, d);
+    }
+    return true;
+}
+
+/* the resolver thread finished the lookup |d| waited for */
+static void
+dialer_resolved_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events)
+{
+    struct dialer_t *d = io->data;
+    struct connection_t *conn = d->conn;
+    const struct opt_t *opt = conn->pool->opt;
+    uint64_t value;
+    int n;
+
+    if (io->fd < 0) {
+        return;
+    }
+    while (read(d->wait.fd, &value, sizeof(value)) == -1 && errno == EINTR)
+        ;
+    if ((n = resolve_lookup(opt->uri, opt->port, d->addrs, &d->wait)) < 0) {
+        return;
+    }
+    loop_io_del(loop, io);
+    d->naddrs = n;
+    if (!dialer_start(d)) {
+        connection_start_failed(conn);
+    }
+}
+
+/*
+ * Start setting up TCP, TLS and the HTTP/2 session for one pool slot.
+ * The loop takes it from here and nothing blocks on the way: the host
+ * is looked up on the resolver thread, sockets stay non-blocking
+ * throughout, the next address is tried from a timer and the whole
+ * setup has -timeout to complete. Returns false when not even a lookup
+ * or connect could be started; the slot is left clean so it can be
+ * retried later.
+ */
+static bool
+connection_start(struct connection_t *conn)
+{
+    struct pool_t *pool = conn->pool;
+    const struct opt_t *opt = pool->opt;
+    struct dialer_t *d = conn->dialer;
+    int i, n, wake_fd;
+
+    conn->want_io = IO_NONE;
+    conn->inflight = 0;
+    conn->settings_received = false;
+    conn->goaway = false;
+    conn->goaway_last_id = 0;
+    conn->ping_sent_us = 0;
+    conn->rtt_us = 0;
+    conn->closing = false;
+    conn->queued = 0;
+    conn->written = 0;
+    conn->data_frame_sent = 0;
+    conn->outlen = 0;
+    conn->out_blocked = false;
+
+    if (d == NULL) {
+        if ((d = malloc(sizeof(*d))) == NULL) {
+            return false;
+        }
+        if ((d->wait.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            free(d);
+            return false;
+        }
+        conn->dialer = d;
+    }
+    wake_fd = d->wait.fd;
+    bzero(d, sizeof(*d));
+    d->conn = conn;
+    d->wait.fd = wake_fd;
+    d->wait_io.fd = -1;
+    for (i = 0; i < MAX_RESOLVED_ADDRS; i++) {
+        d->attempts[i].io.fd = -1;
+        d->attempts[i].dialer = d;
+    }
+    d->start_us = monotonic_us();
+    n = resolve_lookup(opt->uri, opt->port, d->addrs, &d->wait);
+    if (n < 0) {
+        /* readable at once if the lookup ended in between */
+        if (!loop_io_add(pool->loop, &d->wait_io, wake_fd, EPOLLIN, dialer_resolved_cb, d)) {
+            d->wait_io.fd = -1;
+            resolve_cancel(&d->wait);
+            return false;
+        }
+    } else {
+        d->naddrs = n;
+        if (!dialer_start(d)) {
+            return false;
+        }
+    }
+    conn->connecting = true;
+    loop_timer_start(pool->loop, &conn->timer,
+                     opt->timeout > 0 ? (uint64_t)opt->timeout * 1000 : CONNECT_TIMEOUT_MS,
+                     connection_start_timeout_cb, conn);
+    return true;
+}
+
+/*
+ * The first pool->target connections of the default tenant, made
+ * before anything is sent and in parallel. Only this waits for them.
+ */
+static bool
+pool_open(struct pool_t *pool)
+{
+    struct connection_t *conns = pool_slots(pool, g_tenants.dflt);
+    int i;
+
+    for (i = 0; i < pool->target; i++) {
+        if (!connection_start(&conns[i])) {
+            return false;
+        }
+    }
+    while (pool_connecting(pool, g_tenants.dflt) > 0) {
+        loop_run_once(pool->loop);
+    }
+    for (i = 0; i < pool->target; i++) {
+        if (conns[i].session == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+push_free(struct push_t *push)
+{
+    size_t i;
+    for (i = 0; i < push->nheaders; i++) {
+        free(push->headers[i].name);
+        free(push->headers[i].value);
+    }
+    free(push->id);
+    free(push->token);
+    free(push->payload);
+    free(push);
+}
+
+static bool
+push_parse_headers(struct push_t *push, const char *p, const char *e)
+{
+    char name[64];
+    const char *v, *ve;
+    size_t i, len;
+    char *value;
     int rv;
-    rv = nghttp2_session_terminate_session(session, NGHTTP2_NO_ERROR);
 
-    if (rv != 0) {
-      diec("nghttp2_session_terminate_session", rv);
+    if (*p != '{') {
+        return false;
     }
-  }
-  return 0;
+    p++;
+    while ((rv = json_next_member(&p, e, name, sizeof(name), &v, &ve)) == 1) {
+        if (push->nheaders == MAX_PUSH_HEADERS || name[0] == ':' || name[0] == 0) {
+            return false;
+        }
+        if ((value = json_string(v, ve, &len)) == NULL) {
+            return false;
+        }
+        for (i = 0; name[i]; i++) {
+            if (name[i] >= 'A' && name[i] <= 'Z') {
+                name[i] = (char)(name[i] - 'A' + 'a');
+            }
+        }
+        push->headers[push->nheaders].name = (uint8_t *)alloc_string(name);
+        push->headers[push->nheaders].namelen = strlen(name);
+        push->headers[push->nheaders].value = (uint8_t *)value;
+        push->headers[push->nheaders].valuelen = len;
+        /* the push is freed only after its stream closes */
+        push->headers[push->nheaders].flags =
+            NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE;
+        if (string_eq(name, "apns-id")) {
+            /* unique per request, not worth a dynamic table entry */
+            push->headers[push->nheaders].flags |= NGHTTP2_NV_FLAG_NO_INDEX;
+        }
+        push->nheaders++;
+    }
+    return rv == 0;
 }
 
 /*
- * The implementation of nghttp2_on_data_chunk_recv_callback type. We
- * use this function to print the received response body.
+ * Parse one request line:
+ *   {"id":<any>,"token":"<hex>","payload":{...}|"<string>","headers":{"apns-...":"..."}}
+ * Only "token" is required; without "payload" the -payload/-message
+ * body is sent.
  */
-static int on_data_chunk_recv_callback(nghttp2_session *session,
-                                       uint8_t flags _U_, int32_t stream_id,
-                                       const uint8_t *data, size_t len,
-                                       void *user_data _U_) {
-  debug("%s\n",__FUNCTION__);
-  char buf[1024] = {0};
-  memcpy(buf,data,len);
-  buf[len]=0;
-  printf("%s\n",buf);
-  return 0;
+static bool
+push_parse(struct push_t *push, const char *p, const char *e, const char **err)
+{
+    char key[32];
+    const char *v, *ve;
+    const char *t;
+    int rv;
+
+    p = json_ws(p, e);
+    if (p >= e || *p != '{') {
+        *err = "request is not a JSON object";
+        return false;
+    }
+    p++;
+    while ((rv = json_next_member(&p, e, key, sizeof(key), &v, &ve)) == 1) {
+        if (string_eq(key, "id")) {
+            free(push->id);
+            push->id = strndup(v, (size_t)(ve - v));
+        } else if (string_eq(key, "token")) {
+            free(push->token);
+            push->token = json_string(v, ve, NULL);
+            if (push->token == NULL) {
+                *err = "token must be a string";
+                return false;
+            }
+        } else if (string_eq(key, "payload")) {
+            free(push->payload);
+            if (*v == '"') {
+                push->payload = json_string(v, ve, &push->payload_len);
+            } else {
+                push->payload = strndup(v, (size_t)(ve - v));
+                push->payload_len = (size_t)(ve - v);
+            }
+            if (push->payload == NULL) {
+                *err = "bad payload";
+                return false;
+            }
+        } else if (string_eq(key, "headers")) {
+            if (!push_parse_headers(push, v, ve)) {
+                *err = "bad headers";
+                return false;
+            }
+        }
+    }
+    if (rv < 0) {
+        *err = "malformed JSON";
+        return false;
+    }
+    if (push->token == NULL || push->token[0] == 0 || strlen(push->token) >= MAX_TOKEN_LEN) {
+        *err = "missing or bad token";
+        return false;
+    }
+    /* the token ends up in :path */
+    for (t = push->token; *t; t++) {
+        if (!((*t >= '0' && *t <= '9') || (*t >= 'a' && *t <= 'z') || (*t >= 'A' && *t <= 'Z'))) {
+            *err = "missing or bad token";
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+push_has_header(const struct push_t *push, const char *name)
+{
+    size_t i;
+    for (i = 0; i < push->nheaders; i++) {
+        if (push->headers[i].namelen == strlen(name) &&
+            memcmp(push->headers[i].name, name, push->headers[i].namelen) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+client_free(struct client_t *c)
+{
+    buf_free(&c->in);
+    buf_free(&c->out);
+    free(c);
+}
+
+static void
+client_close(struct client_t *c)
+{
+    if (!c->closed) {
+        loop_io_del(c->daemon->pool->loop, &c->io);
+        close(c->fd);
+        c->fd = -1;
+        c->closed = true;
+    }
+    if (c->pending == 0) {
+        client_free(c);
+    }
+}
+
+/*
+ * Write out what is buffered for |c|. Once the client has stopped
+ * sending and every answer is out, the connection is closed. Returns
+ * false if |c| is gone.
+ */
+static bool
+client_flush(struct client_t *c)
+{
+    ssize_t n;
+
+    while (c->out.len > 0) {
+        n = send(c->fd, c->out.data, c->out.len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                loop_io_mod(c->daemon->pool->loop, &c->io, EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            client_close(c);
+            return false;
+        }
+        buf_consume(&c->out, (size_t)n);
+    }
+    loop_io_mod(c->daemon->pool->loop, &c->io, EPOLLIN);
+    if (c->eof && c->pending == 0) {
+        client_close(c);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Answer |push| with one JSON line, see result_json(), and free it.
+ * |st| is the stream that carried it, NULL if it never got one.
+ */
+static void
+daemon_reply(struct push_t *push, const struct stream_t *st, const char *error)
+{
+    struct client_t *c = push->client;
+    bool ok = true;
+
+    if (!c->closed) {
+        ok = result_json(&c->out, st, push->id, push->token, error);
+    }
+    c->pending--;
+    push_free(push);
+    if (!ok) {
+        client_close(c);
+    } else if (c->closed) {
+        if (c->pending == 0) {
+            client_free(c);
+        }
+    } else {
+        client_flush(c);
+    }
+}
+
+static struct push_t*
+daemon_next_push(struct daemon_t *d)
+{
+    struct push_t *push = d->head;
+
+    if (push == NULL) {
+        if (d->draining) {
+            d->pool->batch->eof = true;
+        }
+        return NULL;
+    }
+    d->head = push->next;
+    if (d->head == NULL) {
+        d->tail = NULL;
+    }
+    push->next = NULL;
+    return push;
+}
+
+/* split the client's input into lines and queue each as a request */
+static void
+client_read_requests(struct client_t *c)
+{
+    struct daemon_t *d = c->daemon;
+    size_t off = 0;
+    char *nl;
+
+    while ((nl = memchr(c->in.data + off, '\n', c->in.len - off)) != NULL) {
+        const char *p = c->in.data + off;
+        const char *e = nl;
+        const char *err = NULL;
+        struct push_t *push;
+
+        off = (size_t)(nl - c->in.data) + 1;
+        if (e > p && e[-1] == '\r') {
+            e--;
+        }
+        if (json_ws(p, e) == e) {
+            continue;
+        }
+        push = calloc(1, sizeof(*push));
+        if (push == NULL) {
+            die("alloc push fail.");
+        }
+        push->client = c;
+        c->pending++;
+        if (!push_parse(push, p, e, &err)) {
+            daemon_reply(push, NULL, err);
+            continue;
+        }
+        if (d->pool->opt->topic == NULL && !push_has_header(push, "apns-topic")) {
+            /* -p8 without -topic: every request names its topic */
+            daemon_reply(push, NULL, "missing apns-topic");
+            continue;
+        }
+        if (push->payload == NULL) {
+            push->payload = strndup(d->pool->opt->payload, d->pool->opt->payload_len);
+            push->payload_len = d->pool->opt->payload_len;
+        }
+        if (d->tail) {
+            d->tail->next = push;
+        } else {
+            d->head = push;
+        }
+        d->tail = push;
+    }
+    buf_consume(&c->in, off);
+}
+
+static void
+client_io_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events)
+{
+    struct client_t *c = io->data;
+    struct daemon_t *d = c->daemon;
+    ssize_t n;
+
+    if (events & EPOLLOUT) {
+        if (!client_flush(c)) {
+            return;
+        }
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) || c->eof) {
+        return;
+    }
+    /* held while reading, so answers to bad lines cannot free |c| */
+    c->pending++;
+    while (!c->closed) {
+        if (!buf_reserve(&c->in, 4096)) {
+            die("alloc client buffer fail.");
+        }
+        n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client_close(c);
+            }
+            break;
+        }
+        if (n == 0) {
+            c->eof = true;
+            break;
+        }
+        c->in.len += (size_t)n;
+        client_read_requests(c);
+        if (c->in.len > MAX_REQUEST_LEN) {
+            fprintf(stderr, "daemon: request line too long, client dropped\n");
+            client_close(c);
+        }
+    }
+    pool_dispatch(d->pool);
+    c->pending--;
+    if (c->closed) {
+        if (c->pending == 0) {
+            client_free(c);
+        }
+        return;
+    }
+    if (c->eof) {
+        client_flush(c);
+    }
+}
+
+static void
+daemon_accept_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events)
+{
+    struct daemon_t *d = io->data;
+    struct client_t *c;
+    int fd;
+
+    for (;;) {
+        fd = accept4(d->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "daemon: accept: %s\n", strerror(errno));
+            }
+            return;
+        }
+        c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            die("alloc client fail.");
+        }
+        c->fd = fd;
+        c->daemon = d;
+        if (!loop_io_add(loop, &c->io, fd, EPOLLIN, client_io_cb, c)) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        debug("[INFO] daemon: client fd=%d connected\n", fd);
+    }
 }
 
-/*
- * Setup callback functions. nghttp2 API offers many callback
- * functions, but most of them are optional. The send_callback is
- * always required. Since we use nghttp2_session_recv(), the
- * recv_callback is also required.
- */
+/* SIGHUP: reload the certificates. SIGINT/SIGTERM: stop taking requests,
+   finish the queued ones, exit. The fd is edge triggered, so read until it
+   is empty: signals that arrived together share one wakeup */
 static void
-setup_nghttp2_callbacks(nghttp2_session_callbacks *callbacks)
+daemon_signal_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events)
 {
-  nghttp2_session_callbacks_set_send_callback(callbacks, send_callback);
-  nghttp2_session_callbacks_set_recv_callback(callbacks, recv_callback);
-  nghttp2_session_callbacks_set_on_frame_send_callback(callbacks, on_frame_send_callback);
-  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv_callback);
-  nghttp2_session_callbacks_set_on_header_callback(callbacks,on_header_callback);
-  nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks,on_begin_headers_callback);
-  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close_callback);
-  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk_recv_callback);
+    struct daemon_t *d = io->data;
+    struct signalfd_siginfo si;
 
+    for (;;) {
+        ssize_t r = read(d->signal_fd, &si, sizeof(si));
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r != sizeof(si)) {
+            break;
+        }
+        if (si.ssi_signo == SIGHUP) {
+            /* new connections get the reloaded certificates, the ones in
+               use finish their streams first */
+            int i;
+            tenants_reload();
+            for (i = 0; i < g_tenants.count; i++) {
+                if (pool_tenant_active(d->pool, &g_tenants.list[i])) {
+                    pool_refill(d->pool, &g_tenants.list[i]);
+                }
+            }
+            d->pool->retiring = true;
+            pool_dispatch(d->pool);
+            continue;
+        }
+        if (d->draining) {
+            continue;
+        }
+        fprintf(stderr, "daemon: signal %u, draining\n", si.ssi_signo);
+        d->draining = true;
+        loop_io_del(loop, &d->io);
+        close(d->fd);
+        d->fd = -1;
+        unlink(d->path);
+        pool_dispatch(d->pool);
+        pool_check_done(d->pool);
+    }
 }
 
 static bool
-set_nghttp2_session_info(struct connection_t *conn)
+daemon_start(struct daemon_t *d, struct pool_t *pool)
 {
-    int rv;
-    nghttp2_session_callbacks *callbacks;
+    struct sockaddr_un addr;
+    sigset_t mask;
 
-    rv = nghttp2_session_callbacks_new(&callbacks);
-    if (rv != 0) {
-        fprintf(stderr, "nghttp2_session_callbacks_new");
+    bzero(d, sizeof(*d));
+    d->path = pool->opt->daemon;
+    d->pool = pool;
+    d->fd = d->signal_fd = -1;
+    pool->batch->daemon = d;
+
+    if (strlen(d->path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "daemon: socket path too long: %s\n", d->path);
+        return false;
     }
-    setup_nghttp2_callbacks(callbacks);
-    rv = nghttp2_session_client_new(&conn->session, callbacks, conn);
-    if (rv != 0) {
-        fprintf(stderr, "nghttp2_session_client_new");
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, d->path, strlen(d->path));
+
+    d->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (d->fd < 0) {
+        return false;
+    }
+    /* a stale socket from an earlier run */
+    unlink(d->path);
+    if (bind(d->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(d->fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "daemon: listen on %s: %s\n", d->path, strerror(errno));
+        return false;
+    }
+    if (!loop_io_add(pool->loop, &d->io, d->fd, EPOLLIN, daemon_accept_cb, d)) {
+        return false;
     }
-    nghttp2_session_callbacks_del(callbacks);
 
-    rv = nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, NULL, 0);
-    if (rv != 0) {
-	fprintf(stderr, "nghttp2_submit_settings %d",rv);
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0 ||
+        (d->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        return false;
     }
+    if (!loop_io_add(pool->loop, &d->signal_io, d->signal_fd, EPOLLIN, daemon_signal_cb, d)) {
+        return false;
+    }
+    fprintf(stderr, "daemon: listening on %s\n", d->path);
     return true;
 }
 
-static int
-set_nonblocking(int fd)
+static void
+daemon_stop(struct daemon_t *d)
 {
-    int flags, rv;
-    while ((flags = fcntl(fd, F_GETFL, 0)) == -1 && errno == EINTR)
-        ;
-    if (flags == -1) {
-        return -1;
+    if (d->fd >= 0) {
+        close(d->fd);
+        unlink(d->path);
     }
-    while ((rv = fcntl(fd, F_SETFL, flags | O_NONBLOCK)) == -1 && errno == EINTR)
-        ;
-    if (rv == -1) {
-        return -1;
+    if (d->signal_fd >= 0) {
+        close(d->signal_fd);
     }
-    return 0;
 }
 
-static int
-set_tcp_nodelay(int fd)
+static void
+worker_wake_cb(struct loop_t *loop, struct loop_io_t *io, uint32_t events)
 {
-    int val = 1;
-    if(-1 == setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, (socklen_t)sizeof(val))) {
-        return -1;
-    }
-    return 0;
-}
-
-ssize_t data_prd_read_callback(
-    nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
-    uint32_t *data_flags, nghttp2_data_source *source, void *user_data) {
-
-  const char *d = source->ptr;
-  size_t len = strlen(d);
-
-  memcpy(buf,d,len);
-  *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    struct worker_t *w = io->data;
+    uint64_t n;
 
-  debug("[INFO] C ----------------------------> S (DATA post body)\n");
-  char payload[4096];
-  memcpy(payload,d,len);
-  payload[len]=0;
-  printf("%s\n",payload);
-  return strlen(d);
+    while (read(w->wake_fd, &n, sizeof(n)) == -1 && errno == EINTR)
+        ;
+    /* cleared before draining, so a push racing with us kicks again */
+    atomic_store(&w->notified, false);
+    pool_dispatch(&w->pool);
 }
 
-static int32_t
-submit_request(struct connection_t *conn, const struct opt_t* opt)
+static void*
+worker_main(void *arg)
 {
-    int32_t stream_id;
+    struct worker_t *w = arg;
 
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "worker %d: pin to cpu %d fail\n", w->index, w->cpu);
+        } else {
+            debug("worker %d pinned to cpu %d\n", w->index, w->cpu);
+        }
+    }
 
+    if (!pool_open(&w->pool)) {
+        die("connect fail.");
+    }
+    if (!loop_io_add(&w->loop, &w->wake_io, w->wake_fd, EPOLLIN, worker_wake_cb, w)) {
+        diec("epoll_ctl", errno);
+    }
 
-    const nghttp2_nv nva[] = {
-	      MAKE_NV(":method", "POST"),
-	      MAKE_NV_CS(":path", opt->path),
-	      MAKE_NV_CS("apns-topic", opt->topic)
-	     // MAKE_NV("apns-id", "e77a3d12-bc9f-f410-a127-43f212597a9c")
-    };
+    if (!blocking_post(&w->loop, &w->pool) && w->batch.stranded) {
+        atomic_store(&w->gone, true);
+        eventfd_kick(w->feeder->space_fd);
+    }
+    return NULL;
+}
 
-    nghttp2_data_provider data_prd;
-    data_prd.source.ptr = (void*)opt->payload;
-    data_prd.read_callback = data_prd_read_callback;
+static bool
+worker_init(struct worker_t *w, int index, int nconn, int cpu,
+            const struct opt_t *opt, struct feeder_t *feeder)
+{
+    int i;
 
-    stream_id = nghttp2_submit_request(conn->session, NULL, nva,
-                                       sizeof(nva) / sizeof(nva[0]), &data_prd, conn);
-    return stream_id;
-}
+    bzero(w, sizeof(*w));
+    w->index = index;
+    w->cpu = cpu;
+    w->feeder = feeder;
+    atomic_init(&w->notified, false);
+    atomic_init(&w->input_done, false);
+    atomic_init(&w->gone, false);
+    /* binary tokens, or whole -tokens lines for the template */
+    if (!spsc_init(&w->ring, WORK_QUEUE_SIZE,
+                   opt->tpl ? MAX_RECIPIENT_LEN : sizeof(struct token_t))) {
+        return false;
+    }
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->wake_fd < 0) {
+        return false;
+    }
 
-static void exec_io(struct connection_t *connection) {
-  int rv;
-  rv = nghttp2_session_recv(connection->session);
-  if (rv != 0) {
-    diec("nghttp2_session_recv", rv);
-  }
-  rv = nghttp2_session_send(connection->session);
-  if (rv != 0) {
-    diec("nghttp2_session_send", rv);
-  }
+    loop_init(&w->loop);
+    w->batch.opt = opt;
+    w->batch.worker = w;
+    w->pool.opt = opt;
+    w->pool.batch = &w->batch;
+    w->pool.loop = &w->loop;
+    w->pool.target = nconn;
+    w->pool.size = 2 * nconn * g_tenants.count;
+    w->pool.worker = index;
+    w->pool.out.ring = &g_sink.rings[index];
+    mem_pool_init(&w->pool.mem);
+    w->pool.conns = calloc((size_t)w->pool.size, sizeof(struct connection_t));
+    if (w->pool.conns == NULL) {
+        return false;
+    }
+    for (i = 0; i < w->pool.size; i++) {
+        struct connection_t *conn = &w->pool.conns[i];
+        conn->fd = -1;
+        conn->io.fd = -1;
+        conn->pool = &w->pool;
+        conn->index = index * 2 * MAX_CONNECTIONS * MAX_TENANTS + i;
+        conn->tenant = &g_tenants.list[i / (2 * nconn)];
+    }
+    return true;
 }
 
-static void ctl_poll(struct pollfd *pollfd, struct connection_t *connection) {
-  pollfd->events = 0;
-  if (nghttp2_session_want_read(connection->session) ||
-      connection->want_io == WANT_READ) {
-    pollfd->events |= POLLIN;
-  }
-  if (nghttp2_session_want_write(connection->session) ||
-      connection->want_io == WANT_WRITE) {
-    pollfd->events |= POLLOUT;
-  }
+static void
+worker_destroy(struct worker_t *w)
+{
+    int i;
+    for (i = 0; i < w->pool.size; i++) {
+        connection_cleanup(&w->pool.conns[i]);
+        dialer_free(w->pool.conns[i].dialer);
+    }
+    writer_flush(&w->pool.out);
+    buf_free(&w->pool.out.buf);
+    pool_buckets_free(&w->pool);
+    mem_pool_destroy(&w->pool.mem);
+    free(w->pool.conns);
+    free(w->ring.items);
+    close(w->wake_fd);
+    loop_destroy(&w->loop);
 }
 
+/* the part of the -bench load batch |i| of |n| generates */
 static void
-event_loop(struct loop_t *loop, struct connection_t *conn)
+bench_share(struct batch_t *batch, const struct opt_t *opt, int i, int n)
 {
+    batch->bench_count = opt->bench / (uint64_t)n + ((uint64_t)i < opt->bench % (uint64_t)n ? 1 : 0);
+    batch->bench_rate = opt->rate / n;
+    if (opt->concurrency) {
+        batch->bench_concurrency = opt->concurrency / (uint32_t)n +
+                                   ((uint32_t)i < opt->concurrency % (uint32_t)n ? 1 : 0);
+        if (batch->bench_concurrency == 0) {
+            batch->bench_concurrency = 1;
+        }
+    }
+}
 
-  nfds_t npollfds = 1;
-  struct pollfd pollfds[1];
+/* queue |item| on the next worker in turn that has room */
+static bool
+feed_one(struct worker_t *workers, int n, int *next, const void *item, size_t len)
+{
+    int tries;
+    for (tries = 0; tries < n; tries++) {
+        struct worker_t *w = &workers[*next];
+        *next = (*next + 1) % n;
+        if (atomic_load(&w->gone)) {
+            continue;
+        }
+        if (spsc_push(&w->ring, item, len)) {
+            if (!atomic_exchange(&w->notified, true)) {
+                eventfd_kick(w->wake_fd);
+            }
+            return true;
+        }
+    }
+    return false;
+}
 
-  pollfds[0].fd = conn->fd;
-  ctl_poll(pollfds, conn);
+/*
+ * Every queue is full: sleep until some worker consumes, or gives up.
+ * Returns false once no worker is left to feed.
+ */
+static bool
+wait_for_space(struct worker_t *workers, int n, struct feeder_t *feeder)
+{
+    uint64_t v;
+    int i, live = 0;
 
-  while (nghttp2_session_want_read(conn->session) ||
-         nghttp2_session_want_write(conn->session)) {
-    int nfds = poll(pollfds, npollfds, -1);
-    if (nfds == -1) {
-      diec("poll", errno);
-    }
-    if (pollfds[0].revents & (POLLIN | POLLOUT)) {
-      exec_io(conn);
+    atomic_store(&feeder->waiting, true);
+    for (i = 0; i < n; i++) {
+        if (atomic_load(&workers[i].gone)) {
+            continue;
+        }
+        live++;
+        if (!spsc_full(&workers[i].ring)) {
+            atomic_store(&feeder->waiting, false);
+            return true;
+        }
     }
-    if ((pollfds[0].revents & POLLHUP) || (pollfds[0].revents & POLLERR)) {
-      die("Connection error");
+    if (live > 0) {
+        while (read(feeder->space_fd, &v, sizeof(v)) == -1 && errno == EINTR)
+            ;
     }
-    ctl_poll(pollfds, conn);
-  }
+    atomic_store(&feeder->waiting, false);
+    return live > 0;
 }
 
-static bool
-blocking_post(struct loop_t *loop, struct connection_t *conn, const struct opt_t *opt)
+/*
+ * -threads mode: the calling thread only reads tokens and spreads them
+ * over the worker queues; every worker runs its own loop and share of
+ * the connections, so TLS and HPACK work scale across cores.
+ */
+static void
+run_threads(const struct opt_t *opt, struct batch_t *batch, struct batch_t *total,
+            struct pool_stats_t *stats)
 {
-    set_nonblocking(conn->fd);
-    set_tcp_nodelay(conn->fd);
+    struct worker_t *workers;
+    struct feeder_t feeder;
+    struct token_t bin;
+    const char *line;
+    size_t len;
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+    int n = opt->threads;
+    int i, next = 0;
 
-    int32_t stream_id;
-    stream_id = submit_request(conn, opt);
-    if (stream_id < 0) {
-	printf("stream id error: %d\n",stream_id);
-	return false;
+    if (opt->pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i, &allowed)) {
+                cpus[ncpus++] = i;
+            }
+        }
     }
 
-    debug("[INFO] Stream ID = %d\n", stream_id);
+    atomic_init(&feeder.waiting, false);
+    feeder.space_fd = eventfd(0, EFD_CLOEXEC);
+    if (feeder.space_fd < 0) {
+        diec("eventfd", errno);
+    }
 
-    /* maybe running in a thread */
-    event_loop(loop,conn);
+    workers = calloc((size_t)n, sizeof(struct worker_t));
+    if (workers == NULL) {
+        die("alloc workers fail.");
+    }
+    for (i = 0; i < n; i++) {
+        /* split -connections over the workers, at least one each */
+        int nconn = opt->connections / n + (i < opt->connections % n ? 1 : 0);
+        if (nconn == 0) {
+            nconn = 1;
+        }
+        if (!worker_init(&workers[i], i, nconn, ncpus ? cpus[i % ncpus] : -1, opt, &feeder)) {
+            die("worker init fail.");
+        }
+        bench_share(&workers[i].batch, opt, i, n);
+    }
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            die("pthread_create fail.");
+        }
+    }
 
-    close(loop->epfd);
-    loop->epfd = -1;
-    debug("over.\n");
-    return true;
+    /*
+     * -bench workers make up their own requests. Tokens are checked here
+     * and queued in binary; -template lines go as they are, the workers
+     * pick them apart.
+     */
+    while (!opt->bench && !batch->stranded && batch_next_line(batch, &line, &len)) {
+        const void *item = line;
+        if (opt->tpl) {
+            if (len >= MAX_RECIPIENT_LEN) {
+                fprintf(stderr, "bad -tokens line skipped\n");
+                batch->failed++;
+                continue;
+            }
+            if (batch->seen) {
+                /* the workers report bad lines, only repeats are dropped here */
+                struct fields_t fields;
+                char copy[MAX_RECIPIENT_LEN];
+                memcpy(copy, line, len);
+                copy[len] = 0;
+                if (template_fields(opt->tpl, copy, &fields) &&
+                    token_parse(fields.token, fields.token_len, &bin) &&
+                    batch_duplicate(batch, &bin)) {
+                    continue;
+                }
+            }
+        } else if (!token_parse(line, len, &bin)) {
+            batch_reject_token(batch, line, len);
+            continue;
+        } else if (batch_duplicate(batch, &bin)) {
+            continue;
+        } else {
+            item = &bin;
+            len = sizeof(bin);
+        }
+        while (!feed_one(workers, n, &next, item, len)) {
+            if (!wait_for_space(workers, n, &feeder)) {
+                /* the line in hand is not sent either */
+                batch->stranded = true;
+                break;
+            }
+        }
+    }
+    for (i = 0; i < n; i++) {
+        atomic_store_explicit(&workers[i].input_done, true, memory_order_release);
+        eventfd_kick(workers[i].wake_fd);
+    }
+
+    for (i = 0; i < n; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total->submitted += workers[i].batch.submitted;
+        total->completed += workers[i].batch.completed;
+        total->failed += workers[i].batch.failed;
+        total->retried += workers[i].batch.retried;
+        total->migrated += workers[i].batch.migrated;
+        total->skipped += workers[i].batch.skipped;
+        total->stranded |= workers[i].batch.stranded;
+        pool_stats_add(stats, &workers[i].pool.stats);
+        worker_destroy(&workers[i]);
+    }
+    /* tokens the reader turned away */
+    total->failed += batch->failed;
+    total->duplicates += batch->duplicates;
+    total->stranded |= batch->stranded;
+    free(workers);
+    close(feeder.space_fd);
 }
 
+/* -bench summary: throughput and CPU cost after warm-up, then latency */
 static void
-connection_cleanup(struct connection_t *conn)
+bench_report(const struct opt_t *opt, const struct batch_t *total,
+             const struct pool_stats_t *stats)
 {
-  if (conn->session &&
-      conn->ssl &&
-      conn->ssl_ctx) {
-    nghttp2_session_del(conn->session);
-    SSL_shutdown(conn->ssl);
-    SSL_free(conn->ssl);
-    SSL_CTX_free(conn->ssl_ctx);
-    shutdown(conn->fd, SHUT_WR);
-    close(conn->fd);
-  }
+    struct rusage end;
+    double secs = (double)(monotonic_us() - g_bench.measure_us) / 1e6;
+    double user, sys;
+
+    getrusage(RUSAGE_SELF, &end);
+    user = (double)(end.ru_utime.tv_sec - g_bench.usage.ru_utime.tv_sec) * 1e6 +
+           (double)(end.ru_utime.tv_usec - g_bench.usage.ru_utime.tv_usec);
+    sys = (double)(end.ru_stime.tv_sec - g_bench.usage.ru_stime.tv_sec) * 1e6 +
+          (double)(end.ru_stime.tv_usec - g_bench.usage.ru_stime.tv_usec);
+    fprintf(stderr, "bench: %llu notifications in %.3f s after %d s warm-up, %.1f/s",
+            (unsigned long long)stats->completed, secs, opt->warmup,
+            secs > 0 ? (double)stats->completed / secs : 0.0);
+    if (opt->rate > 0) {
+        fprintf(stderr, " (target %.1f/s)", opt->rate);
+    }
+    fprintf(stderr, ", %llu failed\n", (unsigned long long)total->failed);
+    if (stats->completed) {
+        fprintf(stderr, "bench: cpu %.1f us/notification (user %.1f, sys %.1f)\n",
+                (user + sys) / (double)stats->completed,
+                user / (double)stats->completed, sys / (double)stats->completed);
+    }
+    stats_report("bench", stats, secs);
 }
 
 void
 usage()
 {
-    printf("usage: apns2-test -cert -token [-dev] [-topic|-message|-payload|-uri|-port|-pkey|-prefix] [-debug]\n");
+    printf("usage: apns2-test -cert|-p8 -token|-tokens|-daemon [-dev] [-topic|-message|-payload|-uri|-port|-pkey|-prefix|-connections|-timeout|-threads|-pin|-flush-delay|-session-file|-key-id|-team-id|-dns-ttl|-json|-stats|-stats-interval|-template|-retries|-topic-rate|-ping|-dead-tokens|-dedup|-output|-output-rotate|-output-full] [-debug]\n");
+    printf("       apns2-test -cert|-p8 -bench <count> [-concurrency|-rate|-warmup] [...]\n");
     printf("\nExample:\n./apns2-test -cert cert.pem -token aabbccdd33fa744403fb4447e0f3a054d43f433b80e48c5bcaa62b501fd0f956\n");
 }
 
@@ -769,6 +7416,106 @@ alloc_string(const char* s)
   return m;
 }
 
+static void
+opt_free(struct opt_t *opt)
+{
+    int i;
+
+    free(opt->uri);
+    free(opt->token);
+    free(opt->tokens);
+    free(opt->topic);
+    for (i = 0; i < MAX_TENANTS; i++) {
+        free(opt->certs[i]);
+        free(opt->pkeys[i]);
+    }
+    free(opt->prefix);
+    free(opt->message);
+    free(opt->payload);
+    free(opt->daemon);
+    free(opt->session_file);
+    free(opt->dead_tokens);
+    free(opt->output);
+    free(opt->p8);
+    free(opt->key_id);
+    free(opt->team_id);
+    if (opt->tpl) {
+        free(opt->tpl->text);
+        free(opt->tpl);
+    }
+}
+
+/* -template: the payload itself if it starts with '{', else a file holding it */
+static struct template_t*
+template_load(const char *arg)
+{
+    struct template_t *tpl = malloc(sizeof(*tpl));
+    char *text;
+
+    if (tpl == NULL) {
+        die("alloc template fail.");
+    }
+    if (arg[0] == '{') {
+        text = alloc_string(arg);
+    } else {
+        FILE *fp = fopen(arg, "r");
+        size_t n;
+        if (fp == NULL) {
+            fprintf(stderr, "open -template %s: %s\n", arg, strerror(errno));
+            exit(0);
+        }
+        text = malloc(MAX_PAYLOAD_LEN * 4 + 1);
+        if (text == NULL) {
+            die("alloc template fail.");
+        }
+        n = fread(text, 1, MAX_PAYLOAD_LEN * 4, fp);
+        fclose(fp);
+        while (n > 0 && (text[n - 1] == '\n' || text[n - 1] == '\r')) {
+            n--;
+        }
+        text[n] = 0;
+    }
+    if (!template_parse(tpl, text)) {
+        exit(0);
+    }
+    return tpl;
+}
+
+/*
+ * A -template recipient file is JSON lines if it starts with '{', else
+ * CSV whose first line names the columns.
+ */
+static bool
+template_read_header(struct template_t *tpl, struct input_t *in)
+{
+    char line[MAX_RECIPIENT_LEN];
+    const char *p;
+    size_t len;
+    int c;
+
+    if (in->map) {
+        while (in->pos < in->size && strchr(" \t\r\n", in->map[in->pos])) {
+            in->pos++;
+        }
+        c = in->pos < in->size ? (unsigned char)in->map[in->pos] : EOF;
+    } else {
+        while ((c = getc(in->fp)) == ' ' || c == '\t' || c == '\r' || c == '\n')
+            ;
+        if (c != EOF) {
+            ungetc(c, in->fp);
+        }
+    }
+    if (c == EOF || c == '{') {
+        return true;
+    }
+    if (!input_next(in, &p, &len) || len >= sizeof(line)) {
+        return false;
+    }
+    memcpy(line, p, len);
+    line[len] = 0;
+    return template_bind_csv(tpl, line);
+}
+
 static void
 check_and_make_opt(int argc, const char *argv[], struct opt_t *opt)
 {
@@ -777,9 +7524,23 @@ check_and_make_opt(int argc, const char *argv[], struct opt_t *opt)
   opt->uri      = alloc_string("api.push.apple.com");
   opt->port     = 2197;
   opt->token    = NULL;
+  opt->tokens   = NULL;
+  opt->connections = 1;
+  opt->timeout  = DEFAULT_IO_TIMEOUT;
+  opt->threads  = 0;
+  opt->pin      = false;
+  opt->dedup    = false;
+  opt->flush_delay = 0;
+  opt->daemon   = NULL;
+  opt->session_file = NULL;
+  opt->p8       = NULL;
+  opt->key_id   = NULL;
+  opt->team_id  = NULL;
+  opt->dns_ttl  = DEFAULT_DNS_TTL;
+  opt->retries  = DEFAULT_RETRIES;
+  opt->ping     = DEFAULT_PING_SECS;
   opt->topic    = NULL;
-  opt->cert     = NULL;
-  opt->pkey     = NULL;
+  opt->ncerts   = 0;
   opt->prefix   = alloc_string("/3/device/");
   opt->message  = alloc_string("{\"aps\":{\"alert\":\"%s\",\"sound\":\"default\"}}");
   opt->payload  = alloc_string("{\"aps\":{\"alert\":\"apns2 test.\",\"sound\":\"default\"}}");
@@ -800,59 +7561,341 @@ check_and_make_opt(int argc, const char *argv[], struct opt_t *opt)
 	  opt->port = (uint16_t)atoi(next_arg);
       } else if (string_eq(s,"-token")) {
 	  opt->token    = alloc_string(next_arg);
+      } else if (string_eq(s,"-tokens")) {
+	  opt->tokens   = alloc_string(next_arg);
+      } else if (string_eq(s,"-connections")) {
+	  opt->connections = atoi(next_arg);
+	  if (opt->connections < 1 || opt->connections > MAX_CONNECTIONS) {
+	      fprintf(stderr, "-connections must be 1..%d\n", MAX_CONNECTIONS);
+	      exit(0);
+	  }
+      } else if (string_eq(s,"-threads")) {
+	  opt->threads = atoi(next_arg);
+	  if (opt->threads < 0 || opt->threads > MAX_THREADS) {
+	      fprintf(stderr, "-threads must be 0..%d\n", MAX_THREADS);
+	      exit(0);
+	  }
+      } else if (string_eq(s,"-pin")) {
+	  opt->pin      = true;
+      } else if (string_eq(s,"-dedup")) {
+	  opt->dedup    = true;
+      } else if (string_eq(s,"-timeout")) {
+	  opt->timeout = atoi(next_arg);
+      } else if (string_eq(s,"-flush-delay")) {
+	  opt->flush_delay = atoi(next_arg);
+      } else if (string_eq(s,"-daemon")) {
+	  opt->daemon   = alloc_string(next_arg);
+      } else if (string_eq(s,"-session-file")) {
+	  opt->session_file = alloc_string(next_arg);
+      } else if (string_eq(s,"-output")) {
+	  opt->output = alloc_string(next_arg);
+      } else if (string_eq(s,"-output-rotate")) {
+	  opt->output_rotate = atoi(next_arg);
+      } else if (string_eq(s,"-output-full")) {
+	  if (next_arg == NULL || (!string_eq(next_arg, "block") && !string_eq(next_arg, "drop"))) {
+	      fprintf(stderr, "-output-full must be block or drop\n");
+	      exit(0);
+	  }
+	  opt->output_drop = string_eq(next_arg, "drop");
+      } else if (string_eq(s,"-dead-tokens")) {
+	  opt->dead_tokens = alloc_string(next_arg);
+      } else if (string_eq(s,"-p8")) {
+	  opt->p8       = alloc_string(next_arg);
+	  if (!file_exsit(opt->p8)) exit(0);
+      } else if (string_eq(s,"-key-id")) {
+	  opt->key_id   = alloc_string(next_arg);
+      } else if (string_eq(s,"-team-id")) {
+	  opt->team_id  = alloc_string(next_arg);
+      } else if (string_eq(s,"-dns-ttl")) {
+	  opt->dns_ttl  = atoi(next_arg);
+      } else if (string_eq(s,"-json")) {
+	  opt->json     = true;
+      } else if (string_eq(s,"-stats")) {
+	  opt->stats    = true;
+      } else if (string_eq(s,"-stats-interval")) {
+	  opt->stats_interval = atoi(next_arg);
+      } else if (string_eq(s,"-bench")) {
+	  opt->bench    = strtoull(next_arg, NULL, 10);
+      } else if (string_eq(s,"-concurrency")) {
+	  opt->concurrency = (uint32_t)atoi(next_arg);
+      } else if (string_eq(s,"-rate")) {
+	  opt->rate     = atof(next_arg);
+      } else if (string_eq(s,"-warmup")) {
+	  opt->warmup   = atoi(next_arg);
+      } else if (string_eq(s,"-retries")) {
+	  opt->retries  = atoi(next_arg);
+      } else if (string_eq(s,"-topic-rate")) {
+	  opt->topic_rate = atof(next_arg);
+      } else if (string_eq(s,"-ping")) {
+	  opt->ping     = atoi(next_arg);
       } else if (string_eq(s,"-topic")) {
 	  opt->topic    = alloc_string(next_arg);
       } else if (string_eq(s,"-cert")) {
-	  opt->cert     = alloc_string(next_arg);
-	  if (!file_exsit(opt->cert)) exit(0);
+	  if (opt->ncerts == MAX_TENANTS) {
+	      fprintf(stderr, "at most %d -cert\n", MAX_TENANTS);
+	      exit(0);
+	  }
+	  opt->certs[opt->ncerts] = alloc_string(next_arg);
+	  if (!file_exsit(opt->certs[opt->ncerts++])) exit(0);
       } else if (string_eq(s,"-pkey")) {
-	  opt->pkey     = alloc_string(next_arg);
+	  /* the key of the -cert before it */
+	  int k = opt->ncerts > 0 ? opt->ncerts - 1 : 0;
+	  free(opt->pkeys[k]);
+	  opt->pkeys[k] = alloc_string(next_arg);
       } else if (string_eq(s,"-prefix")) {
 	  opt->prefix   = alloc_string(next_arg);
       } else if (string_eq(s,"-message")) {
 	  char buf[4096] = {0};
-	  snprintf(buf,4096,opt->message,next_arg);
+	  char alert[2048];
+	  ssize_t n = json_escape(alert, sizeof(alert) - 1, next_arg, strlen(next_arg));
+	  if (n < 0) {
+	      fprintf(stderr, "-message too long\n");
+	      exit(0);
+	  }
+	  alert[n] = 0;
+	  snprintf(buf,4096,opt->message,alert);
 	  opt->payload  = alloc_string(buf);
+      } else if (string_eq(s,"-template")) {
+	  opt->tpl      = template_load(next_arg);
       }else if (string_eq(s,"-payload")) {
 	  opt->payload  = alloc_string(next_arg);
       }
   }
 
-  if (opt->cert == NULL ||
-      opt->token == NULL) {
+  if ((opt->ncerts == 0 && opt->p8 == NULL) ||
+      (opt->token == NULL && opt->tokens == NULL && opt->daemon == NULL && opt->bench == 0)) {
       usage();
       exit(0);
   }
-  if (opt->topic == NULL) {
-      opt->topic = get_topic(opt->cert);
+  if (opt->p8 && (opt->key_id == NULL || opt->team_id == NULL)) {
+      fprintf(stderr, "-p8 needs -key-id and -team-id\n");
+      exit(0);
+  }
+  if (opt->p8 && opt->topic == NULL && opt->daemon == NULL) {
+      fprintf(stderr, "-p8 needs -topic\n");
+      exit(0);
+  }
+  if (opt->daemon && (opt->token || opt->tokens)) {
+      fprintf(stderr, "-daemon takes its tokens from the socket, not -token/-tokens\n");
+      exit(0);
+  }
+  if (opt->bench && (opt->tokens || opt->daemon)) {
+      fprintf(stderr, "-bench makes up its own requests (all to -token if given), not -tokens/-daemon\n");
+      exit(0);
+  }
+  if (opt->output_rotate > 0 && (opt->output == NULL || string_eq(opt->output, "-"))) {
+      fprintf(stderr, "-output-rotate is ignored without an -output file\n");
+  }
+  if (opt->dedup && opt->tokens == NULL) {
+      fprintf(stderr, "-dedup is ignored without -tokens\n");
+      opt->dedup = false;
+  }
+  if (opt->daemon && opt->threads > 0) {
+      fprintf(stderr, "-threads is ignored with -daemon\n");
+      opt->threads = 0;
+  }
+  if (opt->tokens && !string_eq(opt->tokens, "-") && !file_exsit(opt->tokens)) {
+      exit(0);
+  }
+  tenants_init(opt);
+  if (opt->topic == NULL && g_tenants.list[0].topic) {
+      opt->topic = alloc_string(g_tenants.list[0].topic);
   }
-  opt->path = make_path(opt->prefix, opt->token);
-  printf("\n");
+  if (opt->topic == NULL && opt->ncerts > 0 && opt->daemon == NULL) {
+      fprintf(stderr, "no UID in %s, -topic is needed\n", opt->certs[0]);
+      exit(0);
+  }
+  g_tenants.dflt = opt->topic ? tenant_for_topic(opt->topic) : &g_tenants.list[0];
+  if (g_tenants.dflt == NULL) {
+      fprintf(stderr, "no -cert is for -topic %s\n", opt->topic);
+      exit(0);
+  }
+  opt->payload_len = strlen(opt->payload);
+  {
+      /* without -topic every -daemon request brings its own */
+      const char *topic = opt->topic ? opt->topic : "";
+      nghttp2_nv headers[2] = {
+          MAKE_NV(":method", "POST", 4),
+          MAKE_NV("apns-topic", topic, strlen(topic))
+      };
+      memcpy(opt->headers, headers, sizeof(headers));
+  }
+  if (!opt->json) {
+      printf("\n");
+  }
+}
+
+/* default mode: every connection is driven from the calling thread */
+static void
+run_single(const struct opt_t *opt, struct batch_t *batch, struct pool_stats_t *stats)
+{
+    struct loop_t loop;
+    struct pool_t pool;
+    struct daemon_t daemon;
+    int i;
+
+    loop_init(&loop);
+
+    bzero(&pool, sizeof(pool));
+    pool.opt = opt;
+    pool.batch = batch;
+    pool.loop = &loop;
+    pool.target = opt->connections;
+    /* other tenants connect on their first request */
+    pool.size = 2 * pool.target * g_tenants.count;
+    pool.worker = -1;
+    pool.out.ring = &g_sink.rings[0];
+    mem_pool_init(&pool.mem);
+    pool.conns = calloc((size_t)pool.size, sizeof(struct connection_t));
+    if (pool.conns == NULL) {
+        die("alloc connections fail.");
+    }
+    for (i = 0; i < pool.size; i++) {
+        struct connection_t *conn = &pool.conns[i];
+        conn->fd = -1;
+        conn->io.fd = -1;
+        conn->pool = &pool;
+        conn->index = i;
+        conn->tenant = &g_tenants.list[i / (2 * pool.target)];
+    }
+    if (!pool_open(&pool)) {
+        die("connect fail.");
+    }
+    if (opt->daemon && !daemon_start(&daemon, &pool)) {
+        die("daemon start fail.");
+    }
+
+    blocking_post(&loop, &pool);
+    *stats = pool.stats;
+    if (opt->daemon) {
+        daemon_stop(&daemon);
+    }
+
+    for (i = 0; i < pool.size; i++) {
+        connection_cleanup(&pool.conns[i]);
+        dialer_free(pool.conns[i].dialer);
+    }
+    writer_flush(&pool.out);
+    buf_free(&pool.out.buf);
+    pool_buckets_free(&pool);
+    mem_pool_destroy(&pool.mem);
+    free(pool.conns);
+    loop_destroy(&loop);
 }
 
 int
 main(int argc, const char *argv[])
 {
-    struct connection_t conn;
-    struct loop_t loop;
     struct opt_t opt;
+    struct batch_t batch;
+    struct batch_t total;
+    struct pool_stats_t stats;
+    struct input_t input;
+    struct token_set_t seen;
+    uint64_t start_us;
 
     check_and_make_opt(argc, argv, &opt);
+    token_codec_init();
+
+    bzero(&batch, sizeof(batch));
+    bzero(&total, sizeof(total));
+    bzero(&stats, sizeof(stats));
+    batch.opt = &opt;
+    if (opt.tokens) {
+        if (!input_open(&input, opt.tokens)) {
+            die("open tokens file fail.");
+        }
+        batch.in = &input;
+        if (opt.tpl && !template_read_header(opt.tpl, &input)) {
+            exit(0);
+        }
+        if (opt.dedup) {
+            /* a mapped file holds at most one token per 65 bytes */
+            token_set_init(&seen, input.size / (TOKEN_HEX_LEN + 1));
+            batch.seen = &seen;
+        }
+    }
 
     debug("apns2-test version: %s\n", APNS2_TEST_VERSION);
     debug("nghttp2 version: %s\n", NGHTTP2_VERSION);
     debug("tls/ssl version: %s\n", SSL_TXT_TLSV1_2);
 
     init_global_library();
+    g_resolver.ttl = opt.dns_ttl;
+    if (opt.session_file) {
+        session_cache_load(opt.session_file);
+    }
+    if (opt.dead_tokens && !dead_store_open(opt.dead_tokens)) {
+        exit(1);
+    }
+    if (opt.p8 && !jwt_init(&g_jwt, &opt)) {
+        die("load -p8 key fail.");
+    }
 
-    socket_connect(opt.uri, opt.port, &conn);
-    if(!ssl_connect(opt.cert, opt.pkey, &conn))
-      die("ssl connect fail.");
-    set_nghttp2_session_info(&conn);
+    /* a peer resetting a connection is connection_lost(), not the end */
+    signal(SIGPIPE, SIG_IGN);
+    sink_open(&opt, opt.threads > 0 ? opt.threads : 1);
+    start_us = monotonic_us();
+    if (opt.bench) {
+        g_bench.start_us = start_us;
+        g_bench.measure_us = start_us + (uint64_t)opt.warmup * 1000000;
+        bench_share(&batch, &opt, 0, 1);
+    }
+    if (opt.threads > 0) {
+        run_threads(&opt, &batch, &total, &stats);
+    } else {
+        run_single(&opt, &batch, &stats);
+        total = batch;
+    }
+    sink_close();
+    if (opt.bench) {
+        bench_report(&opt, &total, &stats);
+    } else if (opt.stats) {
+        stats_report("total", &stats, (double)(monotonic_us() - start_us) / 1e6);
+    }
 
-    blocking_post(&loop, &conn, &opt);
+    debug("tls sessions: %llu resumed, %llu full handshakes\n",
+          (unsigned long long)g_session_cache.resumed,
+          (unsigned long long)g_session_cache.full);
+    if (opt.session_file) {
+        session_cache_save(opt.session_file);
+    }
+    dead_store_close();
+    tenants_free();
+    jwt_destroy(&g_jwt);
 
-    connection_cleanup(&conn);
+    if (opt.tokens || opt.daemon || opt.bench) {
+        fprintf(stderr, "tokens: submitted %llu, completed %llu, failed %llu, skipped %llu, "
+                "duplicates %llu, retried %llu, migrated %llu, reconnects %llu\n",
+                (unsigned long long)total.submitted,
+                (unsigned long long)total.completed,
+                (unsigned long long)total.failed,
+                (unsigned long long)total.skipped,
+                (unsigned long long)total.duplicates,
+                (unsigned long long)total.retried,
+                (unsigned long long)total.migrated,
+                (unsigned long long)stats.reconnects);
+        if (total.submitted) {
+            /* below 1 record per notification, frames of several share a record */
+            fprintf(stderr, "output: %llu bytes in %llu TLS records from %llu SSL_write calls, "
+                    "per notification %.3f records and %.3f writes\n",
+                    (unsigned long long)stats.bytes_out,
+                    (unsigned long long)stats.records,
+                    (unsigned long long)stats.ssl_writes,
+                    (double)stats.records / (double)total.submitted,
+                    (double)stats.ssl_writes / (double)total.submitted);
+        }
+        if (batch.in) {
+            input_close(batch.in);
+        }
+        if (batch.seen) {
+            token_set_free(batch.seen);
+        }
+    }
 
+    opt_free(&opt);
+    if (total.stranded) {
+        die("no usable connection left");
+    }
     return 0;
 }
@@ -0,0 +1,868 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2016 wardenlym
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * mock-apns: a local stand-in for the APNs provider API.
+ *
+ * Speaks HTTP/2 over TLS (ALPN and NPN), optionally verifies the client
+ * certificate, and answers POST /3/device/<token> with a configurable mix
+ * of status codes, reason bodies and response latencies.  Used to exercise
+ * apns2-test's bulk, retry and failover paths without reaching Apple.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+
+#include <nghttp2/nghttp2.h>
+
+#define MOCK_APNS_VERSION "0.1.1"
+
+#define MAX_EVENTS      64
+#define MAX_STATUS_MIX  16
+
+#define MAKE_NV(NAME, VALUE)                                                   \
+  {                                                                            \
+    (uint8_t *) NAME, (uint8_t *)VALUE, sizeof(NAME) - 1, sizeof(VALUE) - 1,   \
+        NGHTTP2_NV_FLAG_NONE                                                   \
+  }
+
+#define MAKE_NV_CS(NAME, VALUE)                                                \
+  {                                                                            \
+    (uint8_t *) NAME, (uint8_t *)VALUE, sizeof(NAME) - 1, strlen(VALUE),       \
+        NGHTTP2_NV_FLAG_NONE                                                   \
+  }
+
+enum {
+    LAT_FIXED,
+    LAT_UNIFORM,
+    LAT_EXP
+};
+
+struct status_mix_t {
+    int status;
+    char reason[64];
+    double weight;
+};
+
+struct mopt_t {
+    uint16_t port;
+    char *cert;
+    char *key;
+    char *ca;
+    uint32_t max_streams;
+    int latency_kind;
+    double latency_a;
+    double latency_b;
+    long goaway_after;
+    double throttle_rate;
+    struct status_mix_t mix[MAX_STATUS_MIX];
+    int nmix;
+    double mix_total;
+};
+
+struct mconn_t;
+
+struct mstream_t {
+    int32_t stream_id;
+    struct mconn_t *conn;
+    char apns_id[40];
+    char body[160];
+    size_t bodylen;
+    size_t bodyoff;
+    int status;
+    /* a request for anything but /3/device/<token> is answered with
+       this instead of the configured mix */
+    const struct status_mix_t *path_error;
+    bool dead;
+    int64_t due_ms;
+    struct mstream_t *tnext;
+};
+
+struct mconn_t {
+    int fd;
+    SSL *ssl;
+    bool handshaken;
+    nghttp2_session *session;
+    int want_io;
+    long served;
+    bool goaway_sent;
+    bool draining;
+    double bucket;
+    int64_t bucket_ms;
+};
+
+enum {
+    IO_NONE,
+    WANT_READ,
+    WANT_WRITE
+};
+
+static struct mopt_t g_opt;
+static int g_debug_flag = 0;
+static volatile sig_atomic_t g_stop = 0;
+static struct mstream_t *g_timers = NULL;
+static long g_total = 0;
+static long g_by_status[600];
+static int g_epfd = -1;
+
+#define debug  if(g_debug_flag) printf
+
+static void
+die(const char *msg)
+{
+    fprintf(stderr, "FATAL: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static int64_t
+now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static double
+rand_unit()
+{
+    return (double)random() / ((double)RAND_MAX + 1.0);
+}
+
+static int64_t
+pick_latency()
+{
+    switch (g_opt.latency_kind) {
+    case LAT_UNIFORM:
+        return (int64_t)(g_opt.latency_a + rand_unit() * (g_opt.latency_b - g_opt.latency_a));
+    case LAT_EXP:
+        return (int64_t)(-log(1.0 - rand_unit()) * g_opt.latency_a);
+    default:
+        return (int64_t)g_opt.latency_a;
+    }
+}
+
+static const struct status_mix_t*
+pick_status()
+{
+    static const struct status_mix_t ok = { 200, "", 1.0 };
+    if (g_opt.nmix == 0) {
+        return &ok;
+    }
+    double r = rand_unit() * g_opt.mix_total;
+    int i;
+    for (i = 0; i < g_opt.nmix; i++) {
+        if (r < g_opt.mix[i].weight) {
+            return &g_opt.mix[i];
+        }
+        r -= g_opt.mix[i].weight;
+    }
+    return &g_opt.mix[g_opt.nmix - 1];
+}
+
+static void
+make_apns_id(char *out)
+{
+    unsigned char b[16];
+    RAND_bytes(b, sizeof(b));
+    snprintf(out, 40,
+             "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+             b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7],
+             b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+}
+
+/* token bucket per connection, refilled at -throttle requests/sec */
+static bool
+throttled(struct mconn_t *conn)
+{
+    if (g_opt.throttle_rate <= 0) {
+        return false;
+    }
+    int64_t now = now_ms();
+    conn->bucket += (double)(now - conn->bucket_ms) * g_opt.throttle_rate / 1000.0;
+    if (conn->bucket > g_opt.throttle_rate) {
+        conn->bucket = g_opt.throttle_rate;
+    }
+    conn->bucket_ms = now;
+    if (conn->bucket < 1.0) {
+        return true;
+    }
+    conn->bucket -= 1.0;
+    return false;
+}
+
+static void
+timer_add(struct mstream_t *st)
+{
+    struct mstream_t **pp = &g_timers;
+    while (*pp && (*pp)->due_ms <= st->due_ms) {
+        pp = &(*pp)->tnext;
+    }
+    st->tnext = *pp;
+    *pp = st;
+}
+
+static void
+timer_remove_conn(struct mconn_t *conn)
+{
+    struct mstream_t **pp = &g_timers;
+    while (*pp) {
+        if ((*pp)->conn == conn) {
+            struct mstream_t *st = *pp;
+            *pp = st->tnext;
+            free(st);
+        } else {
+            pp = &(*pp)->tnext;
+        }
+    }
+}
+
+static ssize_t
+send_callback(nghttp2_session *session, const uint8_t *data,
+              size_t length, int flags, void *user_data)
+{
+    struct mconn_t *conn = user_data;
+    int rv;
+    conn->want_io = IO_NONE;
+    ERR_clear_error();
+    rv = SSL_write(conn->ssl, data, (int)length);
+    if (rv <= 0) {
+        int err = SSL_get_error(conn->ssl, rv);
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+            conn->want_io = (err == SSL_ERROR_WANT_READ ? WANT_READ : WANT_WRITE);
+            return NGHTTP2_ERR_WOULDBLOCK;
+        }
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return rv;
+}
+
+static ssize_t
+recv_callback(nghttp2_session *session, uint8_t *buf,
+              size_t length, int flags, void *user_data)
+{
+    struct mconn_t *conn = user_data;
+    int rv;
+    conn->want_io = IO_NONE;
+    ERR_clear_error();
+    rv = SSL_read(conn->ssl, buf, (int)length);
+    if (rv < 0) {
+        int err = SSL_get_error(conn->ssl, rv);
+        if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+            conn->want_io = (err == SSL_ERROR_WANT_READ ? WANT_READ : WANT_WRITE);
+            return NGHTTP2_ERR_WOULDBLOCK;
+        }
+        return NGHTTP2_ERR_CALLBACK_FAILURE;
+    } else if (rv == 0) {
+        return NGHTTP2_ERR_EOF;
+    }
+    return rv;
+}
+
+static ssize_t
+body_read_callback(nghttp2_session *session, int32_t stream_id, uint8_t *buf,
+                   size_t length, uint32_t *data_flags,
+                   nghttp2_data_source *source, void *user_data)
+{
+    struct mstream_t *st = source->ptr;
+    size_t n = st->bodylen - st->bodyoff;
+    if (n > length) {
+        n = length;
+    }
+    memcpy(buf, st->body + st->bodyoff, n);
+    st->bodyoff += n;
+    if (st->bodyoff == st->bodylen) {
+        *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    }
+    return (ssize_t)n;
+}
+
+static void
+respond(struct mstream_t *st)
+{
+    char status[8];
+    snprintf(status, sizeof(status), "%d", st->status);
+    nghttp2_nv nva[] = {
+        MAKE_NV_CS(":status", status),
+        MAKE_NV_CS("apns-id", st->apns_id)
+    };
+    nghttp2_data_provider prd;
+    prd.source.ptr = st;
+    prd.read_callback = body_read_callback;
+    g_total++;
+    g_by_status[st->status % 600]++;
+    nghttp2_submit_response(st->conn->session, st->stream_id, nva, 2,
+                            st->bodylen ? &prd : NULL);
+}
+
+static void
+prepare_response(struct mconn_t *conn, struct mstream_t *st)
+{
+    const struct status_mix_t *m;
+    struct status_mix_t tm = { 429, "TooManyRequests", 1.0 };
+
+    if (st->path_error) {
+        m = st->path_error;
+    } else {
+        m = throttled(conn) ? &tm : pick_status();
+    }
+    st->status = m->status;
+    if (m->status != 200) {
+        if (m->status == 410) {
+            st->bodylen = (size_t)snprintf(st->body, sizeof(st->body),
+                                           "{\"reason\":\"%s\",\"timestamp\":%lld}",
+                                           m->reason, (long long)time(NULL) * 1000);
+        } else {
+            st->bodylen = (size_t)snprintf(st->body, sizeof(st->body),
+                                           "{\"reason\":\"%s\"}", m->reason);
+        }
+    }
+
+    conn->served++;
+    if (g_opt.goaway_after > 0 && !conn->goaway_sent &&
+        conn->served >= g_opt.goaway_after) {
+        conn->goaway_sent = true;
+        debug("GOAWAY after %ld requests, last-stream-id %d\n", conn->served, st->stream_id);
+        nghttp2_submit_goaway(conn->session, NGHTTP2_FLAG_NONE,
+                              nghttp2_session_get_last_proc_stream_id(conn->session),
+                              NGHTTP2_NO_ERROR, NULL, 0);
+    }
+
+    int64_t lat = pick_latency();
+    if (lat <= 0) {
+        respond(st);
+    } else {
+        st->due_ms = now_ms() + lat;
+        timer_add(st);
+    }
+}
+
+static int
+on_begin_headers_callback(nghttp2_session *session,
+                          const nghttp2_frame *frame, void *user_data)
+{
+    if (frame->hd.type != NGHTTP2_HEADERS ||
+        frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
+        return 0;
+    }
+    struct mstream_t *st = calloc(1, sizeof(*st));
+    st->stream_id = frame->hd.stream_id;
+    st->conn = user_data;
+    make_apns_id(st->apns_id);
+    nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, st);
+    return 0;
+}
+
+static int
+on_header_callback(nghttp2_session *session, const nghttp2_frame *frame,
+                   const uint8_t *name, size_t namelen,
+                   const uint8_t *value, size_t valuelen,
+                   uint8_t flags, void *user_data)
+{
+    static const struct status_mix_t bad_path = { 404, "BadPath", 1.0 };
+    static const struct status_mix_t no_token = { 400, "MissingDeviceToken", 1.0 };
+    struct mstream_t *st = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+    if (st == NULL) {
+        return 0;
+    }
+    if (namelen == 7 && memcmp(name, "apns-id", 7) == 0 && valuelen < sizeof(st->apns_id)) {
+        memcpy(st->apns_id, value, valuelen);
+        st->apns_id[valuelen] = 0;
+    } else if (namelen == 5 && memcmp(name, ":path", 5) == 0) {
+        if (valuelen < 10 || memcmp(value, "/3/device/", 10) != 0) {
+            st->path_error = &bad_path;
+        } else if (valuelen == 10) {
+            st->path_error = &no_token;
+        }
+    }
+    return 0;
+}
+
+static int
+on_frame_recv_callback(nghttp2_session *session,
+                       const nghttp2_frame *frame, void *user_data)
+{
+    if ((frame->hd.type == NGHTTP2_DATA || frame->hd.type == NGHTTP2_HEADERS) &&
+        (frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+        struct mstream_t *st = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+        if (st) {
+            prepare_response(user_data, st);
+        }
+    }
+    return 0;
+}
+
+static int
+on_stream_close_callback(nghttp2_session *session, int32_t stream_id,
+                         uint32_t error_code, void *user_data)
+{
+    struct mstream_t *st = nghttp2_session_get_stream_user_data(session, stream_id);
+    if (st) {
+        if (st->due_ms) {
+            /* still queued on the timer list, freed when it fires */
+            st->dead = true;
+        } else {
+            free(st);
+        }
+    }
+    return 0;
+}
+
+static void
+conn_ctl(int epfd, struct mconn_t *conn);
+
+static void
+timers_run()
+{
+    int64_t now = now_ms();
+    while (g_timers && g_timers->due_ms <= now) {
+        struct mstream_t *st = g_timers;
+        g_timers = st->tnext;
+        st->due_ms = 0;
+        if (st->dead) {
+            free(st);
+            continue;
+        }
+        respond(st);
+        nghttp2_session_send(st->conn->session);
+        conn_ctl(g_epfd, st->conn);
+    }
+}
+
+static int
+select_alpn_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+               const unsigned char *in, unsigned int inlen, void *arg)
+{
+    if (nghttp2_select_next_protocol((unsigned char **)out, outlen, in, inlen) != 1) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static int
+next_proto_cb(SSL *ssl, const unsigned char **data, unsigned int *len, void *arg)
+{
+    static const unsigned char proto[] = "\x02h2";
+    *data = proto;
+    *len = sizeof(proto) - 1;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static SSL_CTX*
+create_ssl_ctx(const struct mopt_t *opt)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        die("SSL_CTX_new");
+    }
+    SSL_CTX_set_options(ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
+                        SSL_OP_NO_COMPRESSION);
+    if (SSL_CTX_use_PrivateKey_file(ctx, opt->key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_use_certificate_chain_file(ctx, opt->cert) != 1) {
+        die("load server certificate/key");
+    }
+    if (opt->ca) {
+        if (SSL_CTX_load_verify_locations(ctx, opt->ca, NULL) != 1) {
+            die("load client CA");
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+        /* required for clients with a certificate to resume sessions */
+        SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"mock-apns", 9);
+    }
+    SSL_CTX_set_next_protos_advertised_cb(ctx, next_proto_cb, NULL);
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn_cb, NULL);
+    return ctx;
+}
+
+static int
+set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int
+listen_on(uint16_t port)
+{
+    struct sockaddr_in6 sa;
+    int val = 1;
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket");
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    val = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val));
+    memset(&sa, 0, sizeof(sa));
+    sa.sin6_family = AF_INET6;
+    sa.sin6_port = htons(port);
+    sa.sin6_addr = in6addr_any;
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 512) != 0) {
+        die("bind/listen");
+    }
+    set_nonblocking(fd);
+    return fd;
+}
+
+static void
+conn_free(struct mconn_t *conn)
+{
+    debug("close fd=%d served=%ld\n", conn->fd, conn->served);
+    timer_remove_conn(conn);
+    if (conn->session) {
+        nghttp2_session_del(conn->session);
+    }
+    SSL_free(conn->ssl);
+    close(conn->fd);
+    free(conn);
+}
+
+static bool
+conn_start_session(struct mconn_t *conn)
+{
+    nghttp2_session_callbacks *callbacks;
+    nghttp2_option *option;
+    nghttp2_settings_entry iv[1] = {
+        { NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, g_opt.max_streams }
+    };
+
+    nghttp2_session_callbacks_new(&callbacks);
+    nghttp2_session_callbacks_set_send_callback(callbacks, send_callback);
+    nghttp2_session_callbacks_set_recv_callback(callbacks, recv_callback);
+    nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, on_begin_headers_callback);
+    nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header_callback);
+    nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv_callback);
+    nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close_callback);
+    /* apns2-test historically omits :scheme/:authority, accept it like APNs does */
+    nghttp2_option_new(&option);
+    nghttp2_option_set_no_http_messaging(option, 1);
+    nghttp2_session_server_new2(&conn->session, callbacks, conn, option);
+    nghttp2_option_del(option);
+    nghttp2_session_callbacks_del(callbacks);
+
+    return nghttp2_submit_settings(conn->session, NGHTTP2_FLAG_NONE, iv, 1) == 0;
+}
+
+/* returns false when the connection should be closed */
+static bool
+conn_io(struct mconn_t *conn)
+{
+    if (!conn->handshaken) {
+        ERR_clear_error();
+        int rv = SSL_do_handshake(conn->ssl);
+        if (rv != 1) {
+            int err = SSL_get_error(conn->ssl, rv);
+            if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                return true;
+            }
+            debug("handshake failed: %s\n", ERR_error_string(ERR_get_error(), NULL));
+            return false;
+        }
+        conn->handshaken = true;
+        if (!conn_start_session(conn)) {
+            return false;
+        }
+    }
+    int rv;
+    if ((rv = nghttp2_session_recv(conn->session)) != 0) {
+        debug("fd=%d nghttp2_session_recv: %s\n", conn->fd, nghttp2_strerror(rv));
+        return false;
+    }
+    if ((rv = nghttp2_session_send(conn->session)) != 0) {
+        debug("fd=%d nghttp2_session_send: %s\n", conn->fd, nghttp2_strerror(rv));
+        return false;
+    }
+    return nghttp2_session_want_read(conn->session) ||
+           nghttp2_session_want_write(conn->session);
+}
+
+static void
+conn_ctl(int epfd, struct mconn_t *conn)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if ((conn->session && nghttp2_session_want_write(conn->session)) ||
+        conn->want_io == WANT_WRITE) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/*
+ * Lingering close: send close_notify and FIN, then discard whatever the
+ * client still had in flight until it closes too. Closing with unread
+ * data would turn into a RST and the client could lose our GOAWAY.
+ */
+static void
+conn_start_drain(int epfd, struct mconn_t *conn)
+{
+    struct epoll_event ev;
+    debug("draining fd=%d\n", conn->fd);
+    conn->draining = true;
+    SSL_shutdown(conn->ssl);
+    shutdown(conn->fd, SHUT_WR);
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static bool
+conn_drain(struct mconn_t *conn)
+{
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(conn->fd, buf, sizeof(buf));
+        if (n > 0) {
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EINTR);
+    }
+}
+
+static void
+on_signal(int sig)
+{
+    g_stop = 1;
+}
+
+static void
+usage()
+{
+    printf("usage: mock-apns -cert <server.crt> -key <server.key> [-ca <client-ca.pem>] [-port|-max-streams|-status|-latency|-goaway-after|-throttle] [-debug]\n");
+    printf("\n  -status <code>:<reason>[:<weight>]   add to the weighted response mix (repeatable)\n");
+    printf("  -latency <ms> | uniform:<min>:<max> | exp:<mean>\n");
+    printf("  -throttle <rps>                      per-connection rate above which 429 is returned\n");
+    printf("\nExample:\n./mock-apns -cert server.crt -key server.key -ca client.pem -status 200::0.9 -status 410:Unregistered:0.1\n");
+}
+
+static bool
+string_eq(const char* a, const char *b)
+{
+    return (0 == strcmp(a,b)) ? true : false;
+}
+
+static void
+parse_status(const char *s)
+{
+    struct status_mix_t *m;
+    if (g_opt.nmix == MAX_STATUS_MIX) {
+        die("too many -status entries");
+    }
+    m = &g_opt.mix[g_opt.nmix++];
+    m->status = atoi(s);
+    m->weight = 1.0;
+    m->reason[0] = 0;
+    const char *p = strchr(s, ':');
+    if (p) {
+        const char *q = strchr(p + 1, ':');
+        size_t n = q ? (size_t)(q - p - 1) : strlen(p + 1);
+        if (n >= sizeof(m->reason)) {
+            n = sizeof(m->reason) - 1;
+        }
+        memcpy(m->reason, p + 1, n);
+        m->reason[n] = 0;
+        if (q) {
+            m->weight = atof(q + 1);
+        }
+    }
+    if (m->status < 100 || m->status > 599) {
+        die("bad -status code");
+    }
+    g_opt.mix_total += m->weight;
+}
+
+static void
+parse_latency(const char *s)
+{
+    if (strncmp(s, "uniform:", 8) == 0) {
+        g_opt.latency_kind = LAT_UNIFORM;
+        sscanf(s + 8, "%lf:%lf", &g_opt.latency_a, &g_opt.latency_b);
+    } else if (strncmp(s, "exp:", 4) == 0) {
+        g_opt.latency_kind = LAT_EXP;
+        g_opt.latency_a = atof(s + 4);
+    } else {
+        g_opt.latency_kind = LAT_FIXED;
+        g_opt.latency_a = atof(s);
+    }
+}
+
+static void
+check_and_make_opt(int argc, const char *argv[], struct mopt_t *opt)
+{
+    memset(opt, 0, sizeof(*opt));
+    opt->port = 2197;
+    opt->max_streams = 1000;
+
+    int i;
+    for (i = 1; i < argc; i++) {
+        const char *s = argv[i];
+        const char *next_arg = (i + 1 < argc) ? argv[i+1] : "";
+
+        if (string_eq(s,"-debug")) {
+            g_debug_flag = 1;
+        } else if (string_eq(s,"-port")) {
+            opt->port = (uint16_t)atoi(next_arg);
+        } else if (string_eq(s,"-cert")) {
+            opt->cert = strdup(next_arg);
+        } else if (string_eq(s,"-key")) {
+            opt->key = strdup(next_arg);
+        } else if (string_eq(s,"-ca")) {
+            opt->ca = strdup(next_arg);
+        } else if (string_eq(s,"-max-streams")) {
+            opt->max_streams = (uint32_t)atoi(next_arg);
+        } else if (string_eq(s,"-status")) {
+            parse_status(next_arg);
+        } else if (string_eq(s,"-latency")) {
+            parse_latency(next_arg);
+        } else if (string_eq(s,"-goaway-after")) {
+            opt->goaway_after = atol(next_arg);
+        } else if (string_eq(s,"-throttle")) {
+            opt->throttle_rate = atof(next_arg);
+        }
+    }
+    if (opt->cert == NULL || opt->key == NULL) {
+        usage();
+        exit(0);
+    }
+}
+
+int
+main(int argc, const char *argv[])
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event ev;
+    SSL_CTX *ssl_ctx;
+    int lfd, epfd;
+
+    check_and_make_opt(argc, argv, &g_opt);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    srandom((unsigned)time(NULL));
+
+    ssl_ctx = create_ssl_ctx(&g_opt);
+    lfd = listen_on(g_opt.port);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        die("epoll_create1");
+    }
+    g_epfd = epfd;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    printf("mock-apns %s listening on :%d (max-streams %u)\n",
+           MOCK_APNS_VERSION, g_opt.port, g_opt.max_streams);
+    fflush(stdout);
+
+    while (!g_stop) {
+        int timeout = -1;
+        if (g_timers) {
+            int64_t d = g_timers->due_ms - now_ms();
+            timeout = d < 0 ? 0 : (int)d;
+        }
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("epoll_wait");
+        }
+        int i;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                int fd;
+                while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+                    int val = 1;
+                    struct mconn_t *conn = calloc(1, sizeof(*conn));
+                    set_nonblocking(fd);
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+                    conn->fd = fd;
+                    conn->ssl = SSL_new(ssl_ctx);
+                    conn->bucket = g_opt.throttle_rate;
+                    conn->bucket_ms = now_ms();
+                    SSL_set_fd(conn->ssl, fd);
+                    SSL_set_accept_state(conn->ssl);
+                    ev.events = EPOLLIN;
+                    ev.data.ptr = conn;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                    debug("accept fd=%d\n", fd);
+                }
+                continue;
+            }
+            struct mconn_t *conn = events[i].data.ptr;
+            if (conn->draining) {
+                if (!conn_drain(conn)) {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    conn_free(conn);
+                }
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                conn_free(conn);
+                continue;
+            }
+            if (!conn_io(conn)) {
+                conn_start_drain(epfd, conn);
+                continue;
+            }
+            conn_ctl(epfd, conn);
+        }
+        timers_run();
+    }
+
+    printf("served %ld responses\n", g_total);
+    int s;
+    for (s = 100; s < 600; s++) {
+        if (g_by_status[s]) {
+            printf("  %d: %ld\n", s, g_by_status[s]);
+        }
+    }
+    close(lfd);
+    close(epfd);
+    SSL_CTX_free(ssl_ctx);
+    return 0;
+}